@@ -7,12 +7,115 @@
 #include <cassert>
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <csignal>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <Eigen>
 
 using namespace Eigen;
 
 const int MAX_DEPTH = 5;
 
+// default Phong constants of every surface; a scene can set its own
+constexpr float KD = 1.f;
+constexpr float KS = 3.f;
+constexpr float ALPHA = 100.f;
+
+// triangle hits must lie this far along the ray, so a ray leaving a mesh does not hit the triangle it starts on
+const float MESH_EPSILON = 1e-3f;
+
+// instruction set used by the sphere leaf kernels
+enum SimdLevel { SIMD_AUTO, SIMD_SCALAR, SIMD_SSE, SIMD_AVX2 };
+
+// how reflection paths are cut short before MAX_DEPTH
+enum Termination
+{
+	TERMINATE_NONE,         // always recurse to MAX_DEPTH
+	TERMINATE_CONTRIBUTION, // stop once the rest of the path cannot change the 8-bit pixel; none for float output or --light-tree
+	TERMINATE_ROULETTE      // Russian roulette on the path weight, unbiased in expectation
+};
+
+// render settings, set from the command line in main()
+struct RenderOptions
+{
+	SimdLevel simd = SIMD_AUTO;
+	unsigned threads = 0;    // worker threads, 0 uses one per hardware thread
+	unsigned tileSize = 16;  // edge length of the square tiles handed to the workers
+	bool scaling = false;    // time the render for 1..N threads and print the speedup curve
+	bool occluderCache = true; // test the last blocker of each light cluster before the BVH
+	unsigned randomSpheres = 0; // extra small spheres scattered over the ground plane
+	unsigned lightSamples = 0; // shadow samples per light cluster, 0 uses every point of the cluster
+	unsigned lightProbes = 0;  // probe samples per cluster before the rest are traced, 0 traces every sample
+	unsigned aaMaxSamples = 1; // camera samples per pixel at most, 1 disables adaptive supersampling
+	float aaThreshold = 0.05f; // colour difference that makes a pixel be refined
+	bool stats = false;        // print the ray counts of the frame
+	std::string heatmapFile;   // per-pixel cost image, needs an RT_PROFILE build
+	Termination termination = TERMINATE_CONTRIBUTION;
+	bool wavefront = false;        // trace the centre samples with the wavefront engine instead of trace()
+	unsigned wavefrontSize = 1 <<16; // paths in flight per wavefront
+	std::string sceneFile;         // text or binary scene to render instead of the built-in one
+	std::string saveText;          // write the scene as text
+	std::string saveBinary;        // write the scene and its BVH as a binary scene
+	std::vector<std::string> meshFiles; // OBJ meshes put in place of the red sphere
+	unsigned instances = 0;        // instances of a shared object scattered over the ground plane
+	std::string animationFile;     // per-frame changes of the scene for a frame sequence
+	unsigned frames = 1;           // frames to render; more than one renders a sequence
+	float refitThreshold = 1.5f;   // rebuild a refitted BVH once its SAH cost grows past this factor
+	std::string benchmarkFile;     // run the benchmark scenes and write the results as JSON ("-": stdout)
+	std::string benchmarkScenes;   // comma-separated benchmark scenes to run, empty runs all
+	std::string output = "./render.ppm"; // .ppm for 8-bit output, .pfm for float radiance
+	float gamma = 1.f;             // gamma applied to 8-bit output
+	unsigned streamRows = 0;       // render and write bands of this many rows, 0 renders the whole frame first
+	std::string framebufferFile;   // keep the frame in this file, tile by tile, instead of in memory
+	unsigned workers = 0;          // render in this many worker processes, 0 renders in this process
+	unsigned workerTimeout = 60;   // seconds a worker may take for a tile before it counts as hung
+	unsigned passes = 0;           // progressive passes of one sample per pixel, 0 renders in one go
+	std::string checkpointFile;    // progressive state is saved here
+	unsigned checkpointEvery = 1;  // passes between checkpoints
+	bool resume = false;           // continue from the checkpoint file if it matches the scene
+	unsigned lightTreeSamples = 0; // light clusters picked per hit with the light tree, 0 evaluates all of them
+	float lightCull = 0;           // skip light clusters whose bounded contribution is below this
+	unsigned randomLights = 0;     // replace the lights with this many single-point lights
+	unsigned denoiseIterations = 0; // a-trous iterations of the denoiser, 0 disables it
+	float denoiseSigma = 6.f;      // colour tolerance of the denoiser's first iteration, in local standard deviations
+	bool checkDenoise = false;     // test that the denoiser brings an undersampled frame closer to the full one
+	bool relight = false;          // shade the frames of a sequence that only change the lighting from cached hits
+	bool incremental = false;      // trace only the pixels that moved objects may change in frames of a sequence
+	bool mortonOrder = false;      // visit tiles, pixels and wavefront paths in Morton order instead of row by row
+	bool sortRays = false;         // sort the wavefront's reflection and shadow rays by direction and origin
+	std::string serveSocket;       // run the render server on this Unix socket ("-": stdin and stdout)
+};
+RenderOptions options;
+
 // image background color
 Vector3f bgcolor(1.0f, 1.0f, 1.0f);
 
@@ -80,171 +183,5930 @@ public:
 	}
 };
 
-// diffuse reflection model
-Vector3f diffuse(const Vector3f &L, // direction vector from the point on the surface towards a light source
-	const Vector3f &N, // normal at this point on the surface
-	const Vector3f &diffuseColor,
-	const float kd // diffuse reflection constant
-)
+// axis-aligned bounding box
+struct AABB
 {
-	Vector3f resColor = Vector3f::Zero();
+	Vector3f min;
+	Vector3f max;
 
-	resColor = kd * std::max(L.dot(N), 0.f) * diffuseColor;
+	AABB() : min(Vector3f::Constant(INFINITY)), max(Vector3f::Constant(-INFINITY))
+	{
+	}
 
-	return resColor;
-}
+	AABB(const Vector3f &mn, const Vector3f &mx) : min(mn), max(mx)
+	{
+	}
 
-// Phong reflection model
-Vector3f phong(const Vector3f &L, // direction vector from the point on the surface towards a light source
-	const Vector3f &N, // normal at this point on the surface
-	const Vector3f &V, // direction pointing towards the viewer
-	const Vector3f &diffuseColor,
-	const Vector3f &specularColor,
-	const float kd, // diffuse reflection constant
-	const float ks, // specular reflection constant
-	const float alpha) // shininess constant
+	void grow(const Vector3f &p)
+	{
+		min = min.cwiseMin(p);
+		max = max.cwiseMax(p);
+	}
+
+	void grow(const AABB &b)
+	{
+		min = min.cwiseMin(b.min);
+		max = max.cwiseMax(b.max);
+	}
+
+	Vector3f centroid() const
+	{
+		return 0.5f * (min + max);
+	}
+
+	float surfaceArea() const
+	{
+		Vector3f e = max - min;
+		if (e(0) < 0) return 0.f;
+		return 2.f * (e(0) * e(1) + e(1) * e(2) + e(2) * e(0));
+	}
+
+	// slab test of a ray against the box; tNear is the entry distance along the ray.
+	// NaNs (origin on a slab plane with a zero direction component) are ignored, which keeps the test conservative.
+	bool intersect(const Vector3f &rayOrigin, const Vector3f &invDirection, float tMax, float &tNear) const
+	{
+		float tmin = -INFINITY;
+		float tmax = INFINITY;
+		for (int a = 0; a < 3; ++a) {
+			float ta = (min(a) - rayOrigin(a)) * invDirection(a);
+			float tb = (max(a) - rayOrigin(a)) * invDirection(a);
+			tmin = std::max(tmin, std::min(ta, tb));
+			tmax = std::min(tmax, std::max(ta, tb));
+		}
+		tNear = tmin;
+		return tmin <= tmax && tmax >= 0 && tmin <= tMax;
+	}
+};
+
+// read-only view of an array that lives elsewhere: in a std::vector of the owner or in a mapped scene file
+template <typename T>
+struct ArrayView
 {
-	Vector3f resColor = Vector3f::Zero();
+	const T *data = nullptr;
+	size_t size = 0;
 
-	Vector3f R = 2 * N*(N.dot(L)) - L;
-	R.normalize();
-	resColor = diffuse(L, N, diffuseColor, kd) + ks * std::powf(std::max(R.dot(V), 0.f), alpha) * specularColor;
+	ArrayView()
+	{
+	}
 
-	return resColor;
+	ArrayView(const T *d, size_t n) : data(d), size(n)
+	{
+	}
+
+	ArrayView(const std::vector<T> &v) : data(v.data()), size(v.size())
+	{
+	}
+
+	const T &operator[](size_t i) const
+	{
+		return data[i];
+	}
+
+	bool empty() const
+	{
+		return size == 0;
+	}
+};
+
+AABB sphereBounds(const Sphere &s)
+{
+	// pad the box slightly so that rounding in the slab test never culls a grazing hit
+	Vector3f r = Vector3f::Constant(s.radius * 1.0001f + 1e-4f);
+	return AABB(s.center - r, s.center + r);
 }
 
-Vector3f trace(
-	const Vector3f &rayOrigin,
-	const Vector3f &rayDirection,
-	const std::vector<Sphere> &spheres,
-	int depth)
+// Instrumentation switches, set with -D on the compiler command line:
+//   RT_COUNTERS  count BVH node and primitive tests per thread (default off)
+//   RT_PROFILE   time the stages of trace() in CPU cycles and record the cost of every pixel (default off)
+// Disabled instrumentation compiles to nothing.
+#ifndef RT_COUNTERS
+#define RT_COUNTERS 0
+#endif
+#ifndef RT_PROFILE
+#define RT_PROFILE 0
+#endif
+
+#if RT_COUNTERS
+#define COUNT_TESTS(counter, n) (threadRays.counter += (n))
+#else
+#define COUNT_TESTS(counter, n) ((void)0)
+#endif
+
+// number of rays traced, by kind, and the intersection tests they took
+struct RayCounts
 {
-	Vector3f pixelColor = Vector3f::Zero();
-	float error = -0.1f;
+	long long primary = 0;
+	long long shadow = 0;
+	long long reflection = 0;
+	long long nodeTests = 0;      // BVH node boxes, top and bottom levels
+	long long primitiveTests = 0; // spheres, triangles and instances
 
-	bool hitSphere = false;
-	float minDistance = INFINITY;
-	Vector3f hitPoint = Vector3f::Zero();
-	int sphereIndex = 0;
+	long long total() const
+	{
+		return primary + shadow + reflection;
+	}
+};
 
-	for (int i = 0; i < spheres.size(); ++i) {
-		float t0, t1;
-		bool intersect = spheres[i].intersect(rayOrigin, rayDirection, t0, t1);
+thread_local RayCounts threadRays;
 
-		if (t0 > error  && intersect)
-		{
-			hitSphere = true;
+// bounding volume hierarchy built with the surface area heuristic (SAH).
+// The tree is stored depth-first: the left child of an interior node directly follows it,
+// `offset` holds the right child for interior nodes and the first primitive for leaves.
+class BVH
+{
+public:
+	struct Node
+	{
+		AABB bounds;
+		int offset;
+		int count; // number of primitives, 0 for interior nodes
+		int axis;  // split axis of interior nodes
+	};
+
+	// traversal stack size, enough for the deepest tree build() makes
+	static const int MAX_STACK = 128;
+
+	// the tree and the primitive indices in leaf order; they view either the storage below or a mapped scene file
+	ArrayView<Node> nodes;
+	ArrayView<int> indices;
+
+	BVH()
+	{
+	}
 
-			if (t0 < minDistance) {
-				minDistance = t0;
-				sphereIndex = i;
-				hitPoint = rayOrigin + t0 * rayDirection;
+	// the views point into the storage, which a move keeps but a copy would not
+	BVH(const BVH &) = delete;
+	BVH &operator=(const BVH &) = delete;
+	BVH(BVH &&) = default;
+	BVH &operator=(BVH &&) = default;
+
+	// leaves hold at most maxLeafSize primitives unless their centroids coincide
+	void build(const std::vector<AABB> &primBounds, int maxLeafSize = 4)
+	{
+		this->maxLeafSize = maxLeafSize;
+		nodeStorage.clear();
+		indexStorage.resize(primBounds.size());
+		for (int i = 0; i < (int)indexStorage.size(); ++i) indexStorage[i] = i;
+		if (!primBounds.empty()) {
+			std::vector<Vector3f> centroids(primBounds.size());
+			for (size_t i = 0; i < primBounds.size(); ++i) centroids[i] = primBounds[i].centroid();
+
+			nodeStorage.reserve(2 * primBounds.size());
+			buildRecursive(primBounds, centroids, 0, (int)primBounds.size(), 0);
+		}
+		nodes = nodeStorage;
+		indices = indexStorage;
+		builtCost = sahCost();
+	}
+
+	// recomputes the node bounds for moved primitives, keeping the tree.
+	// Children follow their parent, so a backward pass sees both children before the node.
+	void refit(const std::vector<AABB> &primBounds)
+	{
+		detach();
+		for (int n = (int)nodeStorage.size() - 1; n >= 0; --n) {
+			Node &node = nodeStorage[n];
+			AABB bounds;
+			if (node.count > 0) {
+				for (int i = node.offset; i < node.offset + node.count; ++i) bounds.grow(primBounds[indexStorage[i]]);
+			}
+			else {
+				bounds.grow(nodeStorage[n + 1].bounds);
+				bounds.grow(nodeStorage[node.offset].bounds);
 			}
+			node.bounds = bounds;
 		}
 	}
 
-	if (!hitSphere) {
-		return bgcolor;
+	// refits the tree, and rebuilds it once refitting has let its SAH cost grow past `threshold` times the
+	// cost after the last build. Returns true if the tree was rebuilt.
+	bool update(const std::vector<AABB> &primBounds, float threshold)
+	{
+		refit(primBounds);
+		if (!(sahCost() > threshold * builtCost)) return false;
+		build(primBounds, maxLeafSize);
+		return true;
 	}
 
-	for (int j = 0; j < 3; ++j) {
-		Vector3f rayOrigin2 = hitPoint;
-		for (int m = 0; m < lightPositions[j].size(); m++) {
-			Vector3f rayDirection2 = lightPositions[j][m] - hitPoint;
-			rayDirection2.normalize();
+	// expected cost of a ray through the tree relative to the root area: one unit per node visited and per
+	// primitive tested
+	float sahCost() const
+	{
+		if (nodes.empty()) return 0.f;
+		float rootArea = nodes[0].bounds.surfaceArea();
+		if (!(rootArea > 0)) return 0.f;
+		double cost = 0;
+		for (size_t n = 0; n < nodes.size; ++n) cost += (double)nodes[n].bounds.surfaceArea() * std::max(nodes[n].count, 1);
+		return (float)(cost / rootArea);
+	}
+
+	// copies a tree that views memory elsewhere into the storage of the BVH, so that it can be changed
+	void detach()
+	{
+		if (nodes.data == nodeStorage.data() && indices.data == indexStorage.data()) return;
+		nodeStorage.assign(nodes.data, nodes.data + nodes.size);
+		indexStorage.assign(indices.data, indices.data + indices.size);
+		nodes = nodeStorage;
+		indices = indexStorage;
+	}
 
-			bool blocked = false;
-			for (int k = 0; k < spheres.size(); ++k) {
-				float t00, t11;
-				bool intersect2 = spheres[k].intersect(rayOrigin2, rayDirection2, t00, t11);
-				if (t00 > error && intersect2) {
-					blocked = true;
-					break;
+	// uses a tree stored elsewhere, e.g. in a mapped scene file, without copying it
+	void attach(const Node *nodeData, size_t nodeCount, const int *indexData, size_t indexCount)
+	{
+		nodeStorage.clear();
+		indexStorage.clear();
+		nodes = ArrayView<Node>(nodeData, nodeCount);
+		indices = ArrayView<int>(indexData, indexCount);
+		builtCost = sahCost();
+	}
+
+	// closest hit: `test(prim, t)` returns true and the hit distance for a primitive hit farther than the caller's tMin.
+	// Ties are resolved towards the lower primitive index so that the result matches a linear scan.
+	// Only hits closer than tMax are looked for.
+	template <typename Test>
+	bool closestHit(const Vector3f &rayOrigin, const Vector3f &rayDirection, Test test, float &tHit, int &primIndex, float tMax = INFINITY) const
+	{
+		return closestHitLeaves(rayOrigin, rayDirection, [&](int begin, int count, float &tBest, int &best) {
+			for (int i = begin; i < begin + count; ++i) {
+				int prim = indices[i];
+				float t;
+				if (test(prim, t) && (t < tBest || (t == tBest && prim < best))) {
+					tBest = t;
+					best = prim;
 				}
 			}
+		}, tHit, primIndex, tMax);
+	}
+
+	// any hit: returns as soon as `test(prim)` reports an intersection
+	template <typename Test>
+	bool anyHit(const Vector3f &rayOrigin, const Vector3f &rayDirection, Test test) const
+	{
+		return anyHitLeaves(rayOrigin, rayDirection, [&](int begin, int count) {
+			for (int i = begin; i < begin + count; ++i) {
+				if (test(indices[i])) return true;
+			}
+			return false;
+		});
+	}
+
+	// closest hit with a whole-leaf test: `test(begin, count, tHit, primIndex)` checks the leaf slots [begin, begin + count)
+	// and updates tHit and primIndex when it finds a closer hit (or an equally close one with a lower primitive index)
+	template <typename LeafTest>
+	bool closestHitLeaves(const Vector3f &rayOrigin, const Vector3f &rayDirection, LeafTest test, float &tHit, int &primIndex, float tMax = INFINITY) const
+	{
+		if (nodes.empty()) return false;
+
+		Vector3f invDirection = rayDirection.cwiseInverse();
+		tHit = tMax;
+		primIndex = -1;
 
-			if (!blocked) {
-				Vector3f N = hitPoint - spheres[sphereIndex].center;
-				N.normalize();
-				Vector3f L = lightPositions[j][m] - hitPoint;
-				L.normalize();
-				Vector3f V = -rayDirection;
-				pixelColor += phong(L, N, V, spheres[sphereIndex].surfaceColor, Vector3f::Ones(), 1.f, 3.f, 100.f) / (3 * lightPositions[j].size());
+		int stack[MAX_STACK];
+		int stackSize = 0;
+		int current = 0;
+		while (true) {
+			const Node &node = nodes[current];
+			float tNear;
+			COUNT_TESTS(nodeTests, 1);
+			if (node.bounds.intersect(rayOrigin, invDirection, tHit, tNear)) {
+				if (node.count > 0) {
+					COUNT_TESTS(primitiveTests, node.count);
+					test(node.offset, node.count, tHit, primIndex);
+				}
+				else {
+					// visit the child on the near side of the split plane first
+					if (rayDirection(node.axis) < 0) {
+						stack[stackSize++] = current + 1;
+						current = node.offset;
+					}
+					else {
+						stack[stackSize++] = node.offset;
+						current = current + 1;
+					}
+					continue;
+				}
 			}
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
 		}
+
+		return primIndex >= 0;
 	}
 
-	if (++depth <= MAX_DEPTH) {
-		if (spheres[sphereIndex].specular) {
-			Vector3f N = hitPoint - spheres[sphereIndex].center;
-			N.normalize();
-			Vector3f L = -rayDirection;
-			L.normalize();
-			Vector3f R = 2 * N*(N.dot(L)) - L;
-			R.normalize();
-			pixelColor = 0.95* pixelColor + 0.05 * trace(hitPoint, R, spheres, depth);
+	// any hit with a whole-leaf test: `test(begin, count)` returns true if anything in the leaf slots is hit
+	template <typename LeafTest>
+	bool anyHitLeaves(const Vector3f &rayOrigin, const Vector3f &rayDirection, LeafTest test) const
+	{
+		if (nodes.empty()) return false;
+
+		Vector3f invDirection = rayDirection.cwiseInverse();
+
+		int stack[MAX_STACK];
+		int stackSize = 0;
+		int current = 0;
+		while (true) {
+			const Node &node = nodes[current];
+			float tNear;
+			COUNT_TESTS(nodeTests, 1);
+			if (node.bounds.intersect(rayOrigin, invDirection, INFINITY, tNear)) {
+				if (node.count > 0) {
+					COUNT_TESTS(primitiveTests, node.count);
+					if (test(node.offset, node.count)) return true;
+				}
+				else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
 		}
+
+		return false;
 	}
 
-	return pixelColor;
+private:
+	static const int SAH_BINS = 16;
+	static const int MAX_SAH_DEPTH = 64; // deeper subtrees are split at the median, which bounds the tree depth
+
+	int maxLeafSize = 4;
+	float builtCost = 0; // sahCost() after the last build
+	std::vector<Node> nodeStorage;
+	std::vector<int> indexStorage;
+
+	int buildRecursive(const std::vector<AABB> &primBounds, const std::vector<Vector3f> &centroids, int begin, int end, int depth)
+	{
+		int nodeIndex = (int)nodeStorage.size();
+		nodeStorage.push_back(Node());
+
+		AABB bounds, centroidBounds;
+		for (int i = begin; i < end; ++i) {
+			bounds.grow(primBounds[indexStorage[i]]);
+			centroidBounds.grow(centroids[indexStorage[i]]);
+		}
+		nodeStorage[nodeIndex].bounds = bounds;
+
+		int count = end - begin;
+		int axis = 0;
+		Vector3f extent = centroidBounds.max - centroidBounds.min;
+		if (extent(1) > extent(axis)) axis = 1;
+		if (extent(2) > extent(axis)) axis = 2;
+
+		// a single primitive, or all centroids coincide: nothing left to split
+		if (count == 1 || extent(axis) <= 0) {
+			makeLeaf(nodeIndex, begin, count);
+			return nodeIndex;
+		}
+
+		if (depth >= MAX_SAH_DEPTH) {
+			int split = begin + count / 2;
+			std::nth_element(indexStorage.begin() + begin, indexStorage.begin() + split, indexStorage.begin() + end,
+				[&](int a, int b) { return centroids[a](axis) < centroids[b](axis); });
+			return makeInterior(primBounds, centroids, nodeIndex, begin, split, end, axis, depth);
+		}
+
+		// bin the centroids along the widest axis and evaluate the SAH at every bin boundary
+		struct Bin { AABB bounds; int count = 0; } bins[SAH_BINS];
+		float scale = SAH_BINS / extent(axis);
+		auto binOf = [&](int prim) {
+			int b = (int)((centroids[prim](axis) - centroidBounds.min(axis)) * scale);
+			return std::min(std::max(b, 0), SAH_BINS - 1);
+		};
+		for (int i = begin; i < end; ++i) {
+			Bin &bin = bins[binOf(indexStorage[i])];
+			bin.count++;
+			bin.bounds.grow(primBounds[indexStorage[i]]);
+		}
+
+		float rightArea[SAH_BINS];
+		int rightCount[SAH_BINS];
+		AABB acc;
+		int n = 0;
+		for (int b = SAH_BINS - 1; b > 0; --b) {
+			acc.grow(bins[b].bounds);
+			n += bins[b].count;
+			rightArea[b] = acc.surfaceArea();
+			rightCount[b] = n;
+		}
+
+		float bestCost = INFINITY;
+		int bestSplit = -1;
+		acc = AABB();
+		n = 0;
+		for (int b = 1; b < SAH_BINS; ++b) {
+			acc.grow(bins[b - 1].bounds);
+			n += bins[b - 1].count;
+			if (n == 0 || rightCount[b] == 0) continue;
+			float cost = acc.surfaceArea() * n + rightArea[b] * rightCount[b];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = b;
+			}
+		}
+
+		// traversal cost 1, intersection cost 1, both relative to the parent area
+		float leafCost = bounds.surfaceArea() * count;
+		if (bestSplit < 0 || (count <= maxLeafSize && bestCost + bounds.surfaceArea() >= leafCost)) {
+			makeLeaf(nodeIndex, begin, count);
+			return nodeIndex;
+		}
+
+		int *mid = std::partition(&indexStorage[begin], &indexStorage[0] + end, [&](int prim) { return binOf(prim) < bestSplit; });
+		int split = (int)(mid - &indexStorage[0]);
+
+		return makeInterior(primBounds, centroids, nodeIndex, begin, split, end, axis, depth);
+	}
+
+	int makeInterior(const std::vector<AABB> &primBounds, const std::vector<Vector3f> &centroids, int nodeIndex, int begin, int split, int end, int axis, int depth)
+	{
+		buildRecursive(primBounds, centroids, begin, split, depth + 1);
+		int right = buildRecursive(primBounds, centroids, split, end, depth + 1);
+		nodeStorage[nodeIndex].offset = right;
+		nodeStorage[nodeIndex].count = 0;
+		nodeStorage[nodeIndex].axis = axis;
+
+		return nodeIndex;
+	}
+
+	void makeLeaf(int nodeIndex, int begin, int count)
+	{
+		// keep leaf primitives in index order so ties are met in the same order as a linear scan
+		std::sort(indexStorage.begin() + begin, indexStorage.begin() + begin + count);
+		nodeStorage[nodeIndex].offset = begin;
+		nodeStorage[nodeIndex].count = count;
+		nodeStorage[nodeIndex].axis = 0;
+	}
+};
+
+// sphere data as structure-of-arrays in BVH leaf order, so a leaf is a contiguous run of every array.
+// The arrays are padded by SIMD_WIDTH spheres that can never be hit, so a full-width load at any leaf stays in bounds.
+struct SphereSoA
+{
+	static const int SIMD_WIDTH = 8;
+
+	// views of the storage below or of a mapped scene file
+	ArrayView<float> centerX, centerY, centerZ, radius, radius2;
+
+	SphereSoA()
+	{
+	}
+
+	SphereSoA(const SphereSoA &) = delete;
+	SphereSoA &operator=(const SphereSoA &) = delete;
+	SphereSoA(SphereSoA &&) = default;
+	SphereSoA &operator=(SphereSoA &&) = default;
+
+	static size_t paddedSize(size_t count)
+	{
+		return count + SIMD_WIDTH;
+	}
+
+	void build(const std::vector<Sphere> &spheres, ArrayView<int> order)
+	{
+		size_t n = paddedSize(order.size);
+		storage.assign(5 * n, 0.f);
+		std::fill(storage.begin() + 4 * n, storage.end(), -1.f);
+		float *x = &storage[0], *y = x + n, *z = y + n, *r = z + n, *r2 = r + n;
+		for (size_t i = 0; i < order.size; ++i) {
+			const Sphere &s = spheres[order[i]];
+			x[i] = s.center(0);
+			y[i] = s.center(1);
+			z[i] = s.center(2);
+			r[i] = s.radius;
+			r2[i] = s.radius * s.radius;
+		}
+		attach(x, n);
+	}
+
+	// uses five consecutive arrays of n floats (x, y, z, radius, radius^2) stored elsewhere
+	void attach(const float *data, size_t n)
+	{
+		centerX = ArrayView<float>(data, n);
+		centerY = ArrayView<float>(data + n, n);
+		centerZ = ArrayView<float>(data + 2 * n, n);
+		radius = ArrayView<float>(data + 3 * n, n);
+		radius2 = ArrayView<float>(data + 4 * n, n);
+	}
+
+private:
+	std::vector<float> storage;
+};
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define RT_TARGET_AVX2
+#else
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+bool cpuSupportsAVX2()
+{
+#if !defined(RT_X86)
+	return false;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
 }
 
-void render(const std::vector<Sphere> &spheres)
+// The kernels below repeat the arithmetic of Sphere::intersect lane by lane, in the same order
+// (Eigen sums a 3-vector dot product as x + (y + z)) and without fused multiply-adds, so their hits
+// are bit-identical to the scalar test. `mask` selects the lanes that belong to the leaf.
+#if defined(RT_X86)
+inline int sphereHitsSSE(const SphereSoA &soa, int begin, int mask, const Vector3f &o, const Vector3f &d, float error, float *t0)
 {
-	unsigned width = 640;
-	unsigned height = 480;
-	Vector3f *image = new Vector3f[width * height];
-	Vector3f *pixel = image;
-	float invWidth = 1 / float(width);
-	float invHeight = 1 / float(height);
-	float fov = 30;
-	float aspectratio = width / float(height);
-	float angle = tan(M_PI * 0.5f * fov / 180.f);
+	__m128 lx = _mm_sub_ps(_mm_loadu_ps(&soa.centerX[begin]), _mm_set1_ps(o(0)));
+	__m128 ly = _mm_sub_ps(_mm_loadu_ps(&soa.centerY[begin]), _mm_set1_ps(o(1)));
+	__m128 lz = _mm_sub_ps(_mm_loadu_ps(&soa.centerZ[begin]), _mm_set1_ps(o(2)));
+	__m128 r2 = _mm_loadu_ps(&soa.radius2[begin]);
+	__m128 tca = _mm_add_ps(_mm_mul_ps(lx, _mm_set1_ps(d(0))),
+		_mm_add_ps(_mm_mul_ps(ly, _mm_set1_ps(d(1))), _mm_mul_ps(lz, _mm_set1_ps(d(2)))));
+	__m128 ll = _mm_add_ps(_mm_mul_ps(lx, lx), _mm_add_ps(_mm_mul_ps(ly, ly), _mm_mul_ps(lz, lz)));
+	__m128 d2 = _mm_sub_ps(ll, _mm_mul_ps(tca, tca));
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tca, _mm_setzero_ps()), _mm_cmple_ps(d2, r2));
+	__m128 t = _mm_sub_ps(tca, _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(r2, d2), _mm_setzero_ps())));
+	hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, _mm_set1_ps(error)));
+	_mm_storeu_ps(t0, t);
+	return _mm_movemask_ps(hit) & mask;
+}
 
-	// Trace rays
-	for (unsigned y = 0; y < height; ++y)
+RT_TARGET_AVX2
+inline int sphereHitsAVX2(const SphereSoA &soa, int begin, int mask, const Vector3f &o, const Vector3f &d, float error, float *t0)
+{
+	__m256 lx = _mm256_sub_ps(_mm256_loadu_ps(&soa.centerX[begin]), _mm256_set1_ps(o(0)));
+	__m256 ly = _mm256_sub_ps(_mm256_loadu_ps(&soa.centerY[begin]), _mm256_set1_ps(o(1)));
+	__m256 lz = _mm256_sub_ps(_mm256_loadu_ps(&soa.centerZ[begin]), _mm256_set1_ps(o(2)));
+	__m256 r2 = _mm256_loadu_ps(&soa.radius2[begin]);
+	__m256 tca = _mm256_add_ps(_mm256_mul_ps(lx, _mm256_set1_ps(d(0))),
+		_mm256_add_ps(_mm256_mul_ps(ly, _mm256_set1_ps(d(1))), _mm256_mul_ps(lz, _mm256_set1_ps(d(2)))));
+	__m256 ll = _mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_add_ps(_mm256_mul_ps(ly, ly), _mm256_mul_ps(lz, lz)));
+	__m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tca, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+	__m256 t = _mm256_sub_ps(tca, _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(r2, d2), _mm256_setzero_ps())));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, _mm256_set1_ps(error), _CMP_GT_OQ));
+	_mm256_storeu_ps(t0, t);
+	return _mm256_movemask_ps(hit) & mask;
+}
+#endif
+
+// ray prepared for the watertight ray-triangle test of Woop, Benthin and Wald (2013). The test works in a frame
+// where the ray starts at the origin and runs along +z, so triangles that share an edge share its edge function
+// exactly and no ray slips through between them.
+struct WatertightRay
+{
+	Vector3f origin, direction;
+	int kx, ky, kz;              // the axis with the largest direction component becomes z
+	float shearX, shearY, shearZ;
+
+	WatertightRay(const Vector3f &o, const Vector3f &d) : origin(o), direction(d)
 	{
-		for (unsigned x = 0; x < width; ++x)
-		{
-			float rayX = (2 * ((x + 0.5f) * invWidth) - 1) * angle * aspectratio;
-			float rayY = (1 - 2 * ((y + 0.5f) * invHeight)) * angle;
-			Vector3f rayDirection(rayX, rayY, -1);
-			rayDirection.normalize();
-			*(pixel++) = trace(Vector3f::Zero(), rayDirection, spheres, 0);
+		kz = 0;
+		if (std::abs(d(1)) > std::abs(d(kz))) kz = 1;
+		if (std::abs(d(2)) > std::abs(d(kz))) kz = 2;
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		// keep the winding of the triangles
+		if (d(kz) < 0) std::swap(kx, ky);
+		shearX = d(kx) / d(kz);
+		shearY = d(ky) / d(kz);
+		shearZ = 1.f / d(kz);
+	}
+};
+
+// watertight ray-triangle test, hit from either side; on a hit with tMin < t < tMax, u and v are the
+// barycentric weights of b and c
+inline bool intersectTriangle(const WatertightRay &ray, const Vector3f &a, const Vector3f &b, const Vector3f &c, float tMin, float tMax, float &t, float &u, float &v)
+{
+	Vector3f A = a - ray.origin;
+	Vector3f B = b - ray.origin;
+	Vector3f C = c - ray.origin;
+	float ax = A(ray.kx) - ray.shearX * A(ray.kz);
+	float ay = A(ray.ky) - ray.shearY * A(ray.kz);
+	float bx = B(ray.kx) - ray.shearX * B(ray.kz);
+	float by = B(ray.ky) - ray.shearY * B(ray.kz);
+	float cx = C(ray.kx) - ray.shearX * C(ray.kz);
+	float cy = C(ray.ky) - ray.shearY * C(ray.kz);
+
+	// edge functions; a zero means the ray passes through an edge, which double precision decides exactly
+	float U = cx * by - cy * bx;
+	float V = ax * cy - ay * cx;
+	float W = bx * ay - by * ax;
+	if (U == 0 || V == 0 || W == 0) {
+		U = (float)((double)cx * by - (double)cy * bx);
+		V = (float)((double)ax * cy - (double)ay * cx);
+		W = (float)((double)bx * ay - (double)by * ax);
+	}
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+	float det = U + V + W;
+	if (det == 0) return false;
+
+	float T = ray.shearZ * (U * A(ray.kz) + V * B(ray.kz) + W * C(ray.kz));
+	t = T / det;
+	if (!(t > tMin && t < tMax)) return false;
+	u = V / det;
+	v = W / det;
+	return true;
+}
+
+// triangle mesh with a single material and its own SAH BVH over the triangles
+class TriangleMesh
+{
+public:
+	std::vector<Vector3f> vertices;
+	std::vector<Vector3f> normals;   // per vertex, for smooth shading
+	std::vector<Vector3i> triangles; // vertex indices
+	Vector3f surfaceColor = Vector3f::Ones();
+	bool specular = false;
+	BVH bvh;
+
+	// where the mesh came from: vertices are the OBJ vertices times scale plus offset
+	std::string file;
+	float scale = 1.f;
+	Vector3f offset = Vector3f::Zero();
+
+	// scales and moves the mesh; done before build()
+	void transform(float s, const Vector3f &o)
+	{
+		for (Vector3f &p : vertices) p = p * s + o;
+		scale *= s;
+		offset = offset * s + o;
+	}
+
+	AABB bounds() const
+	{
+		AABB box;
+		for (const Vector3f &p : vertices) box.grow(p);
+		return box;
+	}
+
+	// fills in missing vertex normals and builds the BVH
+	void build()
+	{
+		computedNormals = normals.size() != vertices.size();
+		if (computedNormals) computeNormals();
+		bvh.build(triangleBounds());
+	}
+
+	// after the vertices moved: recomputes the normals unless they came from the file, and refits or
+	// rebuilds the BVH as BVH::update does. Returns true if the BVH was rebuilt.
+	bool update(float threshold)
+	{
+		if (computedNormals) computeNormals();
+		return bvh.update(triangleBounds(), threshold);
+	}
+
+	// closest triangle hit with tMin < t < tMax
+	bool intersect(const WatertightRay &ray, float tMin, float tMax, float &tHit, int &triangle, float &u, float &v) const
+	{
+		bool hit = bvh.closestHit(ray.origin, ray.direction, [&](int i, float &t) {
+			float bu, bv;
+			return hitTriangle(ray, i, tMin, t, bu, bv);
+		}, tHit, triangle, tMax);
+		if (hit) {
+			float t;
+			hitTriangle(ray, triangle, tMin, t, u, v);
+		}
+		return hit;
+	}
+
+	// true if any triangle is hit farther than tMin
+	bool occluded(const WatertightRay &ray, float tMin) const
+	{
+		return bvh.anyHit(ray.origin, ray.direction, [&](int i) {
+			float t, u, v;
+			return hitTriangle(ray, i, tMin, t, u, v);
+		});
+	}
+
+	// interpolated normal at barycentric position (u, v) of a triangle, on the side the ray came from
+	Vector3f normal(int triangle, float u, float v, const Vector3f &rayDirection) const
+	{
+		const Vector3i &tri = triangles[triangle];
+		Vector3f geometric = (vertices[tri(1)] - vertices[tri(0)]).cross(vertices[tri(2)] - vertices[tri(0)]);
+		Vector3f N = (1 - u - v) * normals[tri(0)] + u * normals[tri(1)] + v * normals[tri(2)];
+		// files disagree on whether normals follow the winding; take them to lie on the side of the face normal
+		if (!(N.dot(geometric) > 0)) N = N.squaredNorm() > 0 ? Vector3f(-N) : geometric;
+		if (geometric.dot(rayDirection) > 0) N = -N;
+		N.normalize();
+		return N;
+	}
+
+private:
+	bool computedNormals = false;
+
+	// area-weighted average of the faces around each vertex
+	void computeNormals()
+	{
+		normals.assign(vertices.size(), Vector3f::Zero());
+		for (const Vector3i &tri : triangles) {
+			Vector3f n = (vertices[tri(1)] - vertices[tri(0)]).cross(vertices[tri(2)] - vertices[tri(0)]);
+			for (int k = 0; k < 3; ++k) normals[tri(k)] += n;
+		}
+		for (Vector3f &n : normals) {
+			if (n.squaredNorm() > 0) n.normalize();
+		}
+	}
+
+	std::vector<AABB> triangleBounds() const
+	{
+		std::vector<AABB> bounds(triangles.size());
+		for (size_t i = 0; i < triangles.size(); ++i) {
+			AABB &box = bounds[i];
+			for (int k = 0; k < 3; ++k) box.grow(vertices[triangles[i](k)]);
+			// pad like the sphere boxes, so that flat boxes of axis-aligned triangles are never culled by rounding
+			Vector3f pad = Vector3f::Constant(1e-4f * (1.f + box.max.cwiseAbs().cwiseMax(box.min.cwiseAbs()).maxCoeff()));
+			box = AABB(box.min - pad, box.max + pad);
 		}
+		return bounds;
 	}
 
-	// Save result to a PPM image
-	std::ofstream ofs("./render.ppm", std::ios::out | std::ios::binary);
-	ofs << "P6\n" << width << " " << height << "\n255\n";
-	for (unsigned i = 0; i < width * height; ++i)
+	bool hitTriangle(const WatertightRay &ray, int i, float tMin, float &t, float &u, float &v) const
 	{
-		const float x = image[i](0);
-		const float y = image[i](1);
-		const float z = image[i](2);
+		const Vector3i &tri = triangles[i];
+		return intersectTriangle(ray, vertices[tri(0)], vertices[tri(1)], vertices[tri(2)], tMin, INFINITY, t, u, v);
+	}
+};
+
+// reads the vertices, vertex normals and faces of an OBJ file; polygons are split into triangle fans.
+// Normals are taken per vertex, as the assignment meshes store them; faces without normals get computed ones.
+bool loadObj(const std::string &path, TriangleMesh &mesh)
+{
+	std::ifstream in(path.c_str());
+	if (!in.is_open()) {
+		std::cerr << "cannot open " << path << std::endl;
+		return false;
+	}
 
-		ofs << (unsigned char)(std::min(float(1), x) * 255)
-			<< (unsigned char)(std::min(float(1), y) * 255)
-			<< (unsigned char)(std::min(float(1), z) * 255);
+	std::vector<Vector3f> objNormals;
+	std::vector<int> vertexNormal;
+	mesh.vertices.clear();
+	mesh.normals.clear();
+	mesh.triangles.clear();
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(in, line)) {
+		++lineNumber;
+		std::istringstream ls(line);
+		std::string keyword;
+		if (!(ls >> keyword)) continue;
+
+		bool ok = true;
+		if (keyword == "v") {
+			Vector3f p;
+			ok = (bool)(ls >> p(0) >> p(1) >> p(2));
+			mesh.vertices.push_back(p);
+			vertexNormal.push_back(-1);
+		}
+		else if (keyword == "vn") {
+			Vector3f n;
+			ok = (bool)(ls >> n(0) >> n(1) >> n(2));
+			objNormals.push_back(n);
+		}
+		else if (keyword == "f") {
+			// v, v/vt, v//vn or v/vt/vn; negative indices count back from the last vertex
+			std::vector<int> face;
+			std::string corner;
+			while (ok && ls >> corner) {
+				int index = std::atoi(corner.c_str());
+				int vertex = index < 0 ? (int)mesh.vertices.size() + index : index - 1;
+				ok = vertex >= 0 && vertex < (int)mesh.vertices.size();
+				// the normal index follows the second slash
+				size_t slash = corner.rfind('/');
+				if (ok && slash != std::string::npos && corner.find('/') != slash && slash + 1 < corner.size()) {
+					int n = std::atoi(corner.c_str() + slash + 1);
+					n = n < 0 ? (int)objNormals.size() + n : n - 1;
+					if (n >= 0 && n < (int)objNormals.size()) vertexNormal[vertex] = n;
+				}
+				face.push_back(vertex);
+			}
+			ok = ok && face.size() >= 3;
+			for (size_t k = 2; ok && k < face.size(); ++k) mesh.triangles.push_back(Vector3i(face[0], face[k - 1], face[k]));
+		}
+		if (!ok) {
+			std::cerr << path << ":" << lineNumber << ": cannot parse '" << line << "'" << std::endl;
+			return false;
+		}
 	}
 
-	ofs.close();
-	delete[] image;
+	// use the file's normals only if every vertex has one
+	if (!objNormals.empty() && std::find(vertexNormal.begin(), vertexNormal.end(), -1) == vertexNormal.end()) {
+		mesh.normals.resize(mesh.vertices.size());
+		for (size_t i = 0; i < mesh.vertices.size(); ++i) mesh.normals[i] = objNormals[vertexNormal[i]].normalized();
+	}
+	mesh.file = path;
+	mesh.scale = 1.f;
+	mesh.offset = Vector3f::Zero();
+	return true;
 }
 
-int main(int argc, char **argv)
+// spheres shared by instances, in object space with their own BVH
+struct SphereGroup
 {
 	std::vector<Sphere> spheres;
-	// position, radius, surface color
-	spheres.push_back(Sphere(Vector3f(0.0, -10004, -20), 10000, Vector3f(0.50, 0.50, 0.50), true));
-	spheres.push_back(Sphere(Vector3f(0.0, 0, -20), 4, Vector3f(1.00, 0.32, 0.36), true));
-	spheres.push_back(Sphere(Vector3f(5.0, -1, -15), 2, Vector3f(0.90, 0.76, 0.46), true));
-	spheres.push_back(Sphere(Vector3f(5.0, 0, -25), 3, Vector3f(0.65, 0.77, 0.97), true));
-	spheres.push_back(Sphere(Vector3f(-5.5, 0, -13), 3, Vector3f(0.90, 0.90, 0.90), true));
-	spheres.push_back(Sphere(Vector3f(3.5, 3, -13), 1, Vector3f(1.00, 1.00, 0.00), true));
-	spheres.push_back(Sphere(Vector3f(-1.5, -1.5, -10), 0.5, Vector3f(0.00, 0.50, 1.00), false));
+	BVH bvh;
+
+	void build()
+	{
+		bvh.build(primitiveBounds());
+	}
+
+	// after spheres moved; returns true if the BVH was rebuilt
+	bool update(float threshold)
+	{
+		return bvh.update(primitiveBounds(), threshold);
+	}
+
+	std::vector<AABB> primitiveBounds() const
+	{
+		std::vector<AABB> bounds(spheres.size());
+		for (size_t i = 0; i < spheres.size(); ++i) bounds[i] = sphereBounds(spheres[i]);
+		return bounds;
+	}
+
+	AABB bounds() const
+	{
+		AABB box;
+		for (const Sphere &sphere : spheres) box.grow(sphereBounds(sphere));
+		return box;
+	}
+
+	// closest sphere surface with tMin < t < tMax along a ray with a unit direction. Unlike the line test of
+	// Sphere::intersect this is a ray test, so a ray leaving a sphere hits its far side.
+	bool intersect(const Vector3f &rayOrigin, const Vector3f &rayDirection, float tMin, float tMax, float &tHit, int &sphereIndex) const
+	{
+		return bvh.closestHit(rayOrigin, rayDirection, [&](int i, float &t) {
+			return hitSphere(spheres[i], rayOrigin, rayDirection, tMin, t);
+		}, tHit, sphereIndex, tMax);
+	}
+
+	bool occluded(const Vector3f &rayOrigin, const Vector3f &rayDirection, float tMin) const
+	{
+		return bvh.anyHit(rayOrigin, rayDirection, [&](int i) {
+			float t;
+			return hitSphere(spheres[i], rayOrigin, rayDirection, tMin, t);
+		});
+	}
+
+private:
+	static bool hitSphere(const Sphere &sphere, const Vector3f &rayOrigin, const Vector3f &rayDirection, float tMin, float &t)
+	{
+		Vector3f l = sphere.center - rayOrigin;
+		float tca = l.dot(rayDirection);
+		float d2 = l.dot(l) - tca * tca;
+		float r2 = sphere.radius * sphere.radius;
+		if (d2 > r2) return false;
+		float thc = sqrt(r2 - d2);
+		t = tca - thc;
+		if (!(t > tMin)) t = tca + thc;
+		return t > tMin;
+	}
+};
+
+// placement of a shared mesh or sphere group in the world: p_world = linear * p_object + translation.
+// Instances only hold the transform, so the geometry is stored once however often it is placed.
+struct Instance
+{
+	int mesh = -1;  // index into Scene::meshes, or
+	int group = -1; // index into Scene::groups
+	Matrix3f linear = Matrix3f::Identity();
+	Vector3f translation = Vector3f::Zero();
+	Matrix3f inverseLinear = Matrix3f::Identity();
+	Vector3f inverseTranslation = Vector3f::Zero();
+
+	void setTransform(const Matrix3f &l, const Vector3f &t)
+	{
+		linear = l;
+		translation = t;
+		inverseLinear = l.inverse();
+		inverseTranslation = -(inverseLinear * t);
+	}
+
+	Vector3f toObject(const Vector3f &p) const
+	{
+		return inverseLinear * p + inverseTranslation;
+	}
+
+	// world normal of an object-space normal (the inverse transpose keeps it perpendicular to the surface)
+	Vector3f normalToWorld(const Vector3f &n) const
+	{
+		return (inverseLinear.transpose() * n).normalized();
+	}
+
+	// world box around the transformed corners of an object box
+	AABB worldBounds(const AABB &object) const
+	{
+		AABB box;
+		for (int c = 0; c < 8; ++c) {
+			Vector3f corner((c & 1) ? object.max(0) : object.min(0), (c & 2) ? object.max(1) : object.min(1), (c & 4) ? object.max(2) : object.min(2));
+			box.grow(linear * corner + translation);
+		}
+		return box;
+	}
+};
+
+// read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	MappedFile()
+	{
+	}
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (view) UnmapViewOfFile(view);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (view) munmap((void *)view, length);
+		if (fd >= 0) close(fd);
+#endif
+	}
+
+	bool open(const std::string &path)
+	{
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return false;
+		length = (size_t)fileSize.QuadPart;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!mapping) return false;
+		view = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+		length = (size_t)st.st_size;
+		void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) return false;
+		view = (const char *)p;
+#endif
+		return view != nullptr;
+	}
+
+	const char *data() const
+	{
+		return view;
+	}
+
+	size_t size() const
+	{
+		return length;
+	}
+
+private:
+	const char *view = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// hash of a point's coordinate bits and a seed, for per-point choices that do not consume random state
+inline uint32_t pointHash(const Vector3f &p, uint32_t seed)
+{
+	uint32_t h = seed * 0x9E3779B9u;
+	for (int c = 0; c < 3; ++c) {
+		uint32_t bits;
+		std::memcpy(&bits, &p(c), sizeof(bits));
+		h = (h ^ bits) * 0x85EBCA6Bu;
+		h ^= h >> 13;
+	}
+	return h;
+}
+
+// hierarchy over the light clusters, for picking the lights that matter at a shading point. Every cluster
+// has the same weight in the Phong sum, and the Phong term has no distance falloff, so what a light can
+// contribute depends only on its direction: the bounds below take the cone of directions from the shading
+// point to a node's box and bound the diffuse cosine and the specular lobe over that cone.
+class LightTree
+{
+public:
+	void build(const std::vector<std::vector<Vector3f>> &lights, float kd, float ks, float alpha)
+	{
+		this->kd = kd;
+		this->ks = ks;
+		this->alpha = alpha;
+		clusterCount = (int)lights.size();
+		std::vector<AABB> bounds(lights.size());
+		for (size_t i = 0; i < lights.size(); ++i) {
+			for (const Vector3f &light : lights[i]) bounds[i].grow(light);
+		}
+		bvh.build(bounds, 1);
+
+		// children follow their parent in the node array, so a reverse sweep sees them first
+		counts.assign(bvh.nodes.size, 0);
+		for (int i = (int)bvh.nodes.size - 1; i >= 0; --i) {
+			const BVH::Node &node = bvh.nodes[i];
+			counts[i] = node.count > 0 ? node.count : counts[i + 1] + counts[node.offset];
+		}
+	}
+
+	// upper bound of one cluster's share of the direct light (as shadeCluster() sums it over the
+	// cluster's samples) for a cluster inside `box`, at point p with normal N, where mirrorV is the view
+	// direction mirrored about N and albedo the largest channel of the surface colour
+	float bound(const AABB &box, const Vector3f &p, const Vector3f &N, const Vector3f &mirrorV, float albedo) const
+	{
+		Cone cone(box, p);
+		// R.V in phong() equals L.mirrorV
+		return (kd * albedo * cone.maxCos(N) + ks * std::pow(cone.maxCos(mirrorV), alpha)) / clusterCount;
+	}
+
+	// bound() >= cull, with the same rounding. Most clusters that pass the cull face the shading point, and
+	// for those the diffuse term alone settles it without the specular lobe's pow().
+	bool reaches(const AABB &box, const Vector3f &p, const Vector3f &N, const Vector3f &mirrorV, float albedo, float cull) const
+	{
+		Cone cone(box, p);
+		float diffuse = kd * albedo * cone.maxCos(N);
+		if (diffuse / clusterCount >= cull) return true;
+		return (diffuse + ks * std::pow(cone.maxCos(mirrorV), alpha)) / clusterCount >= cull;
+	}
+
+	// picks a cluster with probability proportional to the bound of its subtree at each level, using the
+	// number u in [0, 1). Subtrees whose per-cluster bound is below `cull` are never picked. Returns -1 if
+	// no cluster can contribute.
+	int sample(const Vector3f &p, const Vector3f &N, const Vector3f &mirrorV, float albedo, float cull, float u, float &pdf) const
+	{
+		pdf = 1.f;
+		if (bvh.nodes.empty()) return -1;
+		auto importance = [&](int node) {
+			float b = bound(bvh.nodes[node].bounds, p, N, mirrorV, albedo);
+			return b < cull ? 0.f : b * counts[node];
+		};
+		int current = 0;
+		if (importance(current) <= 0) return -1;
+		while (bvh.nodes[current].count == 0) {
+			int left = current + 1;
+			int right = bvh.nodes[current].offset;
+			float l = importance(left);
+			float r = importance(right);
+			// the children's cones are narrower than the parent's, so both bounds may vanish
+			if (l + r <= 0) return -1;
+			float pLeft = l / (l + r);
+			if (u < pLeft) {
+				u /= pLeft;
+				pdf *= pLeft;
+				current = left;
+			}
+			else {
+				u = (u - pLeft) / (1 - pLeft);
+				pdf *= 1 - pLeft;
+				current = right;
+			}
+			u = std::min(u, 0.99999994f);
+		}
+		// leaves hold one cluster unless several share a centroid; those are picked uniformly
+		const BVH::Node &leaf = bvh.nodes[current];
+		int k = std::min((int)(u * leaf.count), leaf.count - 1);
+		pdf /= leaf.count;
+		return bvh.indices[leaf.offset + k];
+	}
+
+	// calls visit(cluster) for every cluster whose bound is at least `cull`, skipping whole subtrees
+	template <typename Visit>
+	void collect(const Vector3f &p, const Vector3f &N, const Vector3f &mirrorV, float albedo, float cull, Visit visit) const
+	{
+		if (bvh.nodes.empty()) return;
+		int stack[BVH::MAX_STACK];
+		int stackSize = 0;
+		int current = 0;
+		while (true) {
+			const BVH::Node &node = bvh.nodes[current];
+			if (reaches(node.bounds, p, N, mirrorV, albedo, cull)) {
+				if (node.count > 0) {
+					for (int i = 0; i < node.count; ++i) visit(bvh.indices[node.offset + i]);
+				}
+				else {
+					stack[stackSize++] = node.offset;
+					current = current + 1;
+					continue;
+				}
+			}
+			if (stackSize == 0) break;
+			current = stack[--stackSize];
+		}
+	}
+
+private:
+	// cone of the directions from a point to a box's bounding sphere
+	struct Cone
+	{
+		Vector3f axis;
+		float sinTheta = 1, cosTheta = -1; // the whole sphere of directions if the point is inside
+
+		Cone(const AABB &box, const Vector3f &p)
+		{
+			axis = box.centroid() - p;
+			float distance = axis.norm();
+			float radius = 0.5f * (box.max - box.min).norm();
+			if (distance <= radius) return;
+			axis /= distance;
+			sinTheta = radius / distance;
+			cosTheta = std::sqrt(std::max(0.f, 1 - sinTheta * sinTheta));
+		}
+
+		// largest cosine between a direction of the cone and `direction`
+		float maxCos(const Vector3f &direction) const
+		{
+			if (cosTheta < 0) return 1.f;
+			float cosA = direction.dot(axis);
+			if (cosA >= cosTheta) return 1.f;
+			float sinA = std::sqrt(std::max(0.f, 1 - cosA * cosA));
+			return std::max(0.f, cosA * cosTheta + sinA * sinTheta);
+		}
+	};
+
+	BVH bvh;
+	std::vector<int> counts; // clusters below each node
+	int clusterCount = 0;
+	float kd = KD, ks = KS, alpha = ALPHA;
+};
+
+// pinhole camera, by default at the origin looking down -z. The columns of `orientation` are the camera's
+// right, up and backward directions in the scene.
+struct Camera
+{
+	unsigned width = 640;
+	unsigned height = 480;
+	float fov = 30;
+	Vector3f position = Vector3f::Zero();
+	Vector3f target = Vector3f(0, 0, -1); // as given to lookAt(), for saving the scene
+	Matrix3f orientation = Matrix3f::Identity();
+
+	// places the camera at `eye` looking at `target`, with the scene's +y up in the image
+	void lookAt(const Vector3f &eye, const Vector3f &target)
+	{
+		Vector3f backward = (eye - target).normalized();
+		Vector3f right = Vector3f::UnitY().cross(backward);
+		// looking straight up or down, any right direction will do
+		if (right.squaredNorm() < 1e-12f) right = Vector3f::UnitX();
+		right.normalize();
+		position = eye;
+		this->target = target;
+		orientation.col(0) = right;
+		orientation.col(1) = backward.cross(right);
+		orientation.col(2) = backward;
+	}
+
+	// direction of the ray through image position (px, py), in pixels from the top-left corner
+	Vector3f rayDirection(float px, float py) const
+	{
+		float invWidth = 1 / float(width);
+		float invHeight = 1 / float(height);
+		float aspectratio = width / float(height);
+		float angle = tan(M_PI * 0.5f * fov / 180.f);
+
+		float rayX = (2 * (px * invWidth) - 1) * angle * aspectratio;
+		float rayY = (1 - 2 * (py * invHeight)) * angle;
+		Vector3f rayDirection = orientation * Vector3f(rayX, rayY, -1);
+		rayDirection.normalize();
+		return rayDirection;
+	}
+};
+
+// closest hit of a ray: a sphere of the scene, or inside an instance a triangle of its mesh at barycentric
+// position (u, v) or a sphere of its group
+struct Hit
+{
+	float t;
+	int sphere = -1;   // into Scene::spheres, or into the group of the instance
+	int instance = -1;
+	int triangle = -1;
+	float u = 0, v = 0;
+};
+
+// how the Phong term raises R.V to the shininess, settled once per scene so that the shading kernels are
+// specialised on it instead of branching for every light sample
+enum SpecularKind
+{
+	SPECULAR_NONE,    // ks is 0: diffuse only
+	SPECULAR_DEFAULT, // the default ALPHA, by repeated squaring unrolled at compile time
+	SPECULAR_INTEGER, // another integer exponent, by repeated squaring
+	SPECULAR_REAL,    // std::powf
+	SPECULAR_COUNT
+};
+
+// spheres and instanced objects together with their acceleration structures. The spheres have a BVH of
+// their own; meshes and sphere groups are shared objects with bottom-level BVHs in object space, placed by
+// instances under a top-level BVH.
+struct Scene
+{
+	Camera camera;
+	Vector3f background = bgcolor;
+	std::vector<std::vector<Vector3f>> lights = lightPositions; // clusters of point lights
+	float kd = KD, ks = KS, alpha = ALPHA; // Phong constants of every surface
+	SpecularKind specularKind = SPECULAR_DEFAULT;
+	std::vector<Sphere> spheres;
+	std::vector<TriangleMesh> meshes;
+	std::vector<SphereGroup> groups;
+	std::vector<Instance> instances;
+	BVH instanceBVH;
+	BVH bvh;
+	SphereSoA soa;
+	std::shared_ptr<MappedFile> mapping; // binary scene file that bvh and soa point into
+	SimdLevel simd = SIMD_SCALAR;
+	volatile int kernelProbeHits = 0; // camera rays that hit something while fastestKernel() timed the kernels
+	float maxRadiance = 0; // upper bound of any colour returned by trace() without --light-tree
+	bool floatOutput = false; // the frame is written as float radiance, so no 8-bit step bounds a path
+	bool averagedOutput = false; // pixels average or filter several samples, so one sample's 8-bit step bounds nothing
+	LightTree lightTree;
+
+	// sets the output flags that decide whether contribution termination may cut paths of the next frames
+	void setOutput(bool floatImage)
+	{
+		floatOutput = floatImage;
+		averagedOutput = options.aaMaxSamples > 1 || options.passes > 0 || options.denoiseIterations > 0;
+	}
+
+	// builds the BVH and the leaf-ordered SoA copy of the spheres. Leaves stay at 4 spheres for every kernel:
+	// with 8-sphere leaves the AVX2 kernel was no faster on 1k and 100k spheres, the extra sphere tests eating
+	// what the wider kernel saves.
+	void build(SimdLevel level = SIMD_AUTO)
+	{
+		bvh.build(sphereBoundsList());
+		soa.build(spheres, bvh.indices);
+		mapping.reset();
+		buildObjects();
+		prepare(level);
+	}
+
+	// brings the acceleration structures up to date after spheres, mesh vertices or instances moved. Every
+	// BVH is refitted bottom-up in place, and only rebuilt once its SAH cost has grown past `threshold` times
+	// its cost after the last build. Returns the number of rebuilt trees.
+	int update(float threshold)
+	{
+		int rebuilt = bvh.update(sphereBoundsList(), threshold);
+		soa.build(spheres, bvh.indices);
+		mapping.reset();
+		for (TriangleMesh &mesh : meshes) rebuilt += mesh.update(threshold);
+		for (SphereGroup &group : groups) rebuilt += group.update(threshold);
+		rebuilt += instanceBVH.update(instanceBounds(), threshold);
+		return rebuilt;
+	}
+
+	// builds the bottom-level BVHs of the shared objects and the top-level BVH over the instances
+	void buildObjects()
+	{
+		for (TriangleMesh &mesh : meshes) mesh.build();
+		for (SphereGroup &group : groups) group.build();
+		instanceBVH.build(instanceBounds());
+	}
+
+	// refits the top-level BVH after instances were moved with Instance::setTransform; the shared objects
+	// and the tree topology stay as they are
+	void refitInstances()
+	{
+		instanceBVH.refit(instanceBounds());
+	}
+
+	int addInstance(int mesh, int group, const Matrix3f &linear, const Vector3f &translation)
+	{
+		Instance instance;
+		instance.mesh = mesh;
+		instance.group = group;
+		instance.setTransform(linear, translation);
+		instances.push_back(instance);
+		return (int)instances.size() - 1;
+	}
+
+	// picks the leaf kernel and derives the per-scene constants; the BVH and SoA must be in place
+	void prepare(SimdLevel level = SIMD_AUTO)
+	{
+		simd = level;
+		if (simd == SIMD_AVX2 && !cpuSupportsAVX2()) simd = SIMD_SSE;
+		if (simd == SIMD_AUTO) simd = fastestKernel();
+#if !defined(RT_X86)
+		simd = SIMD_SCALAR;
+#endif
+		prepareLighting();
+	}
+
+	// times the leaf kernels on camera rays through a coarse grid of the image and returns the fastest. Which
+	// kernel wins depends on the CPU and the scene, not on the instruction width alone. All kernels find the
+	// same hits, so the choice only changes the speed.
+	SimdLevel fastestKernel()
+	{
+		std::vector<SimdLevel> candidates = { SIMD_SCALAR, SIMD_SSE };
+		if (cpuSupportsAVX2()) candidates.push_back(SIMD_AVX2);
+		// small scenes are scanned linearly and never reach a kernel
+		if (spheres.size() <= LINEAR_SPHERES) return candidates.back();
+
+		const int GRID = 32;
+		std::vector<Vector3f> directions;
+		for (int k = 0; k < GRID * GRID; ++k) {
+			directions.push_back(camera.rayDirection((k % GRID + 0.5f) * camera.width / GRID, (k / GRID + 0.5f) * camera.height / GRID));
+		}
+		RayCounts counts = threadRays;
+		std::vector<double> best(candidates.size(), INFINITY);
+		int hits = 0;
+		for (int round = 0; round < 3; ++round) {
+			for (size_t c = 0; c < candidates.size(); ++c) {
+				simd = candidates[c];
+				auto start = std::chrono::steady_clock::now();
+				for (const Vector3f &direction : directions) {
+					float t;
+					int index;
+					hits += intersectSpheres(camera.position, direction, -0.1f, t, index);
+				}
+				best[c] = std::min(best[c], std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+		}
+		threadRays = counts;
+		kernelProbeHits = hits; // keeps the timed loops from being optimised away
+		return candidates[std::min_element(best.begin(), best.end()) - best.begin()];
+	}
+
+	// derives what depends on the lights, the surface colours and the Phong constants, after they changed
+	void prepareLighting()
+	{
+		lightTree.build(lights, kd, ks, alpha);
+		if (ks == 0) specularKind = SPECULAR_NONE;
+		else if (alpha == ALPHA) specularKind = SPECULAR_DEFAULT;
+		else if (alpha >= 0 && alpha <= 1 << 16 && alpha == std::floor(alpha)) specularKind = SPECULAR_INTEGER;
+		else specularKind = SPECULAR_REAL;
+
+		// the direct light at a hit is an average of Phong terms, each at most kd * colour + ks,
+		// and a reflection blends that with its child, so no path returns more than this
+		maxRadiance = background.maxCoeff();
+		for (const Sphere &sphere : spheres) maxRadiance = std::max(maxRadiance, kd * sphere.surfaceColor.maxCoeff() + ks);
+		for (const TriangleMesh &mesh : meshes) maxRadiance = std::max(maxRadiance, kd * mesh.surfaceColor.maxCoeff() + ks);
+		for (const SphereGroup &group : groups) {
+			for (const Sphere &sphere : group.spheres) maxRadiance = std::max(maxRadiance, kd * sphere.surfaceColor.maxCoeff() + ks);
+		}
+	}
+
+	// closest hit farther than `error` along the line for the scene's spheres, as tested by Sphere::intersect,
+	// and farther than MESH_EPSILON for instanced objects. The scene's spheres win a tie.
+	bool intersect(const Vector3f &rayOrigin, const Vector3f &rayDirection, float error, Hit &hit) const
+	{
+		hit.instance = -1;
+		if (!intersectSpheres(rayOrigin, rayDirection, error, hit.t, hit.sphere)) {
+			hit.t = INFINITY;
+			hit.sphere = -1;
+		}
+		if (instances.empty()) return hit.sphere >= 0;
+
+		float tMin = std::max(error, MESH_EPSILON);
+		// instances only report hits closer than hit.t, which the traversal keeps as its bound
+		float tInstance;
+		int instanceIndex;
+		instanceBVH.closestHitLeaves(rayOrigin, rayDirection, [&](int begin, int count, float &tBest, int &best) {
+			for (int i = begin; i < begin + count; ++i) {
+				int instance = instanceBVH.indices[i];
+				if (intersectInstance(instance, rayOrigin, rayDirection, tMin, hit)) {
+					tBest = hit.t;
+					best = instance;
+				}
+			}
+		}, tInstance, instanceIndex, hit.t);
+		return hit.sphere >= 0 || hit.instance >= 0;
+	}
+
+	// unit normal at a hit point; mesh normals face the side the ray came from
+	Vector3f normal(const Hit &hit, const Vector3f &hitPoint, const Vector3f &rayDirection) const
+	{
+		if (hit.instance >= 0) {
+			const Instance &instance = instances[hit.instance];
+			if (instance.mesh >= 0) {
+				return instance.normalToWorld(meshes[instance.mesh].normal(hit.triangle, hit.u, hit.v, instance.inverseLinear * rayDirection));
+			}
+			return instance.normalToWorld(instance.toObject(hitPoint) - groups[instance.group].spheres[hit.sphere].center);
+		}
+		Vector3f N = hitPoint - spheres[hit.sphere].center;
+		N.normalize();
+		return N;
+	}
+
+	const Vector3f &surfaceColor(const Hit &hit) const
+	{
+		if (hit.instance < 0) return spheres[hit.sphere].surfaceColor;
+		const Instance &instance = instances[hit.instance];
+		return instance.mesh >= 0 ? meshes[instance.mesh].surfaceColor : groups[instance.group].spheres[hit.sphere].surfaceColor;
+	}
+
+	bool specular(const Hit &hit) const
+	{
+		if (hit.instance < 0) return spheres[hit.sphere].specular;
+		const Instance &instance = instances[hit.instance];
+		return instance.mesh >= 0 ? meshes[instance.mesh].specular : groups[instance.group].spheres[hit.sphere].specular;
+	}
+
+	// true if anything is hit farther than `error` (MESH_EPSILON for instanced objects) along the line;
+	// a blocking sphere of the scene is stored in `occluder`, a blocking instance leaves it at -1
+	bool occluded(const Vector3f &rayOrigin, const Vector3f &rayDirection, float error, int &occluder) const
+	{
+		occluder = -1;
+		if (occludedBySpheres(rayOrigin, rayDirection, error, occluder)) return true;
+		if (instances.empty()) return false;
+
+		float tMin = std::max(error, MESH_EPSILON);
+		return instanceBVH.anyHit(rayOrigin, rayDirection, [&](int i) {
+			const Instance &instance = instances[i];
+			Vector3f origin = instance.toObject(rayOrigin);
+			Vector3f direction = instance.inverseLinear * rayDirection;
+			if (instance.mesh >= 0) return meshes[instance.mesh].occluded(WatertightRay(origin, direction), tMin);
+			float scale = direction.norm();
+			return groups[instance.group].occluded(origin, direction / scale, tMin * scale);
+		});
+	}
+
+	// true if sphere i is hit farther than `error` along the line
+	bool occludedBy(int i, const Vector3f &rayOrigin, const Vector3f &rayDirection, float error) const
+	{
+		COUNT_TESTS(primitiveTests, 1);
+		float t0, t1;
+		return spheres[i].intersect(rayOrigin, rayDirection, t0, t1) && t0 > error;
+	}
+
+	// world bounds of sphere i of the scene
+	AABB sphereBox(int i) const
+	{
+		return sphereBounds(spheres[i]);
+	}
+
+	// world bounds of instance i
+	AABB instanceBox(int i) const
+	{
+		const Instance &instance = instances[i];
+		return instance.worldBounds(instance.mesh >= 0 ? meshes[instance.mesh].bounds() : groups[instance.group].bounds());
+	}
+
+private:
+	// up to this many spheres a linear scan is faster than the BVH, whose box tests cost more than they save
+	static const size_t LINEAR_SPHERES = 32;
+
+	std::vector<AABB> sphereBoundsList() const
+	{
+		std::vector<AABB> bounds(spheres.size());
+		for (size_t i = 0; i < spheres.size(); ++i) bounds[i] = sphereBounds(spheres[i]);
+		return bounds;
+	}
+
+	std::vector<AABB> instanceBounds() const
+	{
+		// object boxes are shared by all instances of an object
+		std::vector<AABB> meshBounds, groupBounds;
+		for (const TriangleMesh &mesh : meshes) meshBounds.push_back(mesh.bounds());
+		for (const SphereGroup &group : groups) groupBounds.push_back(group.bounds());
+
+		std::vector<AABB> bounds(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i) {
+			const Instance &instance = instances[i];
+			bounds[i] = instance.worldBounds(instance.mesh >= 0 ? meshBounds[instance.mesh] : groupBounds[instance.group]);
+		}
+		return bounds;
+	}
+
+	// replaces `hit` by a hit on the instance with tMin < t < hit.t. The ray is taken into object space
+	// without normalizing the direction, so t keeps its world-space meaning; sphere groups need a unit
+	// direction and scale t back.
+	bool intersectInstance(int i, const Vector3f &rayOrigin, const Vector3f &rayDirection, float tMin, Hit &hit) const
+	{
+		const Instance &instance = instances[i];
+		Vector3f origin = instance.toObject(rayOrigin);
+		Vector3f direction = instance.inverseLinear * rayDirection;
+		float t, u = 0, v = 0;
+		int prim;
+		if (instance.mesh >= 0) {
+			if (!meshes[instance.mesh].intersect(WatertightRay(origin, direction), tMin, hit.t, t, prim, u, v)) return false;
+		}
+		else {
+			float scale = direction.norm();
+			if (!groups[instance.group].intersect(origin, direction / scale, tMin * scale, hit.t * scale, t, prim)) return false;
+			t /= scale;
+			if (!(t < hit.t)) return false;
+		}
+		hit.t = t;
+		hit.instance = i;
+		hit.sphere = instance.mesh >= 0 ? -1 : prim;
+		hit.triangle = instance.mesh >= 0 ? prim : -1;
+		hit.u = u;
+		hit.v = v;
+		return true;
+	}
+
+	// closest sphere hit farther than `error` along the line
+	bool intersectSpheres(const Vector3f &rayOrigin, const Vector3f &rayDirection, float error, float &tHit, int &sphereIndex) const
+	{
+		if (spheres.size() <= LINEAR_SPHERES) {
+			// in index order, so a tie goes to the lower index as in the BVH traversal
+			COUNT_TESTS(primitiveTests, spheres.size());
+			tHit = INFINITY;
+			sphereIndex = -1;
+			for (int i = 0; i < (int)spheres.size(); ++i) {
+				float t0, t1;
+				if (spheres[i].intersect(rayOrigin, rayDirection, t0, t1) && t0 > error && t0 < tHit) {
+					tHit = t0;
+					sphereIndex = i;
+				}
+			}
+			return sphereIndex >= 0;
+		}
+		if (simd == SIMD_SCALAR) {
+			return bvh.closestHit(rayOrigin, rayDirection, [&](int i, float &t) {
+				float t0, t1;
+				if (!spheres[i].intersect(rayOrigin, rayDirection, t0, t1) || !(t0 > error)) return false;
+				t = t0;
+				return true;
+			}, tHit, sphereIndex);
+		}
+
+		return bvh.closestHitLeaves(rayOrigin, rayDirection, [&](int begin, int count, float &tBest, int &best) {
+			for (int chunk = begin; chunk < begin + count; chunk += SphereSoA::SIMD_WIDTH) {
+				float t0[SphereSoA::SIMD_WIDTH];
+				int hits = leafHits(chunk, std::min(begin + count - chunk, (int)SphereSoA::SIMD_WIDTH), rayOrigin, rayDirection, error, t0);
+				for (int lane = 0; hits; ++lane, hits >>= 1) {
+					if (!(hits & 1)) continue;
+					int prim = bvh.indices[chunk + lane];
+					if (t0[lane] < tBest || (t0[lane] == tBest && prim < best)) {
+						tBest = t0[lane];
+						best = prim;
+					}
+				}
+			}
+		}, tHit, sphereIndex);
+	}
+
+	// true if any sphere is hit farther than `error` along the line; the blocking sphere is stored in `occluder`
+	bool occludedBySpheres(const Vector3f &rayOrigin, const Vector3f &rayDirection, float error, int &occluder) const
+	{
+		if (spheres.size() <= LINEAR_SPHERES) {
+			for (int i = 0; i < (int)spheres.size(); ++i) {
+				COUNT_TESTS(primitiveTests, 1);
+				float t0, t1;
+				if (spheres[i].intersect(rayOrigin, rayDirection, t0, t1) && t0 > error) {
+					occluder = i;
+					return true;
+				}
+			}
+			return false;
+		}
+		if (simd == SIMD_SCALAR) {
+			return bvh.anyHit(rayOrigin, rayDirection, [&](int i) {
+				float t0, t1;
+				if (!spheres[i].intersect(rayOrigin, rayDirection, t0, t1) || !(t0 > error)) return false;
+				occluder = i;
+				return true;
+			});
+		}
+
+		return bvh.anyHitLeaves(rayOrigin, rayDirection, [&](int begin, int count) {
+			for (int chunk = begin; chunk < begin + count; chunk += SphereSoA::SIMD_WIDTH) {
+				float t0[SphereSoA::SIMD_WIDTH];
+				int hits = leafHits(chunk, std::min(begin + count - chunk, (int)SphereSoA::SIMD_WIDTH), rayOrigin, rayDirection, error, t0);
+				if (!hits) continue;
+				int lane = 0;
+				while (!(hits & (1 << lane))) ++lane;
+				occluder = bvh.indices[chunk + lane];
+				return true;
+			}
+			return false;
+		});
+	}
+
+	// bit mask of the (at most SIMD_WIDTH) spheres from slot `begin` on that are hit farther than `error`,
+	// with their entry distances in t0
+	int leafHits(int begin, int count, const Vector3f &o, const Vector3f &d, float error, float *t0) const
+	{
+#if defined(RT_X86)
+		if (simd == SIMD_AVX2) return sphereHitsAVX2(soa, begin, (1 << count) - 1, o, d, error, t0);
+		int hits = sphereHitsSSE(soa, begin, count >= 4 ? 0xf : (1 << count) - 1, o, d, error, t0);
+		if (count > 4) hits |= sphereHitsSSE(soa, begin + 4, (1 << (count - 4)) - 1, o, d, error, t0 + 4) << 4;
+		return hits;
+#else
+		return 0;
+#endif
+	}
+};
+
+// diffuse reflection model
+Vector3f diffuse(const Vector3f &L, // direction vector from the point on the surface towards a light source
+	const Vector3f &N, // normal at this point on the surface
+	const Vector3f &diffuseColor,
+	const float kd // diffuse reflection constant
+)
+{
+	Vector3f resColor = Vector3f::Zero();
+
+	resColor = kd * std::max(L.dot(N), 0.f) * diffuseColor;
+
+	return resColor;
+}
+
+// x^N by repeated squaring, unrolled at compile time
+template <unsigned N>
+struct IntegerPower
+{
+	static float of(float x)
+	{
+		float half = IntegerPower<N / 2>::of(x);
+		return N % 2 ? half * half * x : half * half;
+	}
+};
+
+template <>
+struct IntegerPower<0>
+{
+	static float of(float) { return 1.f; }
+};
+
+// x^n by repeated squaring
+float integerPower(float x, unsigned n)
+{
+	float result = 1.f;
+	for (; n > 0; n >>= 1) {
+		if (n & 1) result *= x;
+		x *= x;
+	}
+	return result;
+}
+
+// the specular exponents of the SpecularKinds: each raises R.V to the scene's shininess
+struct NoSpecular
+{
+	static const bool enabled = false;
+	explicit NoSpecular(const Scene &) {}
+	float operator()(float) const { return 0.f; }
+};
+
+struct DefaultSpecular
+{
+	static const bool enabled = true;
+	static_assert(ALPHA == (unsigned)ALPHA, "the default shininess must be an integer");
+	explicit DefaultSpecular(const Scene &) {}
+	float operator()(float x) const { return IntegerPower<(unsigned)ALPHA>::of(x); }
+};
+
+struct IntegerSpecular
+{
+	static const bool enabled = true;
+	unsigned alpha;
+	explicit IntegerSpecular(const Scene &scene) : alpha((unsigned)scene.alpha) {}
+	float operator()(float x) const { return integerPower(x, alpha); }
+};
+
+struct RealSpecular
+{
+	static const bool enabled = true;
+	float alpha;
+	explicit RealSpecular(const Scene &scene) : alpha(scene.alpha) {}
+	float operator()(float x) const { return std::powf(x, alpha); }
+};
+
+// Phong reflection model
+template <typename Specular>
+Vector3f phong(const Vector3f &L, // direction vector from the point on the surface towards a light source
+	const Vector3f &N, // normal at this point on the surface
+	const Vector3f &V, // direction pointing towards the viewer
+	const Vector3f &diffuseColor,
+	const Vector3f &specularColor,
+	const float kd, // diffuse reflection constant
+	const float ks, // specular reflection constant
+	const Specular &specular) // raises R.V to the shininess
+{
+	if (!Specular::enabled) return diffuse(L, N, diffuseColor, kd);
+
+	Vector3f resColor = Vector3f::Zero();
+
+	Vector3f R = 2 * N*(N.dot(L)) - L;
+	R.normalize();
+	resColor = diffuse(L, N, diffuseColor, kd) + ks * specular(std::max(R.dot(V), 0.f)) * specularColor;
+
+	return resColor;
+}
+
+// stages of trace() timed by RT_PROFILE
+enum Stage
+{
+	STAGE_INTERSECT, // closest hit and surface normal
+	STAGE_SHADOW,    // shadow rays
+	STAGE_SHADE,     // phong() of the unblocked light samples
+	STAGE_COUNT
+};
+
+const char *const STAGE_NAMES[STAGE_COUNT] = { "intersect", "shadow", "shade" };
+
+// CPU cycles spent in each stage, separately for camera rays (depth 0) and for the reflection recursion
+struct StageProfile
+{
+	unsigned long long cycles[2][STAGE_COUNT] = {};
+	unsigned long long calls[2][STAGE_COUNT] = {};
+	unsigned long long pixelCycles = 0; // whole camera samples, so the rest of trace() is the difference
+};
+
+thread_local StageProfile threadProfile;
+StageProfile frameProfile;
+
+// cost of every pixel in cycles, summed over all of its camera samples; only recorded while not empty
+std::vector<float> pixelCost;
+unsigned pixelCostWidth = 0;
+
+inline unsigned long long cycleCount()
+{
+#if defined(RT_X86)
+	return __rdtsc();
+#else
+	return (unsigned long long)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+#if RT_PROFILE
+// adds the cycles of its scope to a stage of the running thread
+class StageTimer
+{
+public:
+	StageTimer(int depth, Stage stage) : depth(depth > 0), stage(stage), start(cycleCount())
+	{
+	}
+
+	~StageTimer()
+	{
+		threadProfile.cycles[depth][stage] += cycleCount() - start;
+		threadProfile.calls[depth][stage]++;
+	}
+
+private:
+	int depth;
+	Stage stage;
+	unsigned long long start;
+};
+
+#define PROFILE_STAGE(depth, stage) StageTimer stageTimer(depth, stage)
+#define PROFILE_PIXEL_BEGIN() unsigned long long pixelStart = cycleCount()
+#define PROFILE_PIXEL_END(x, y) recordPixel(x, y, cycleCount() - pixelStart)
+#else
+// the arguments are still evaluated, so that parameters only passed on to the profile do not go unused
+#define PROFILE_STAGE(depth, stage) ((void)(depth), (void)(stage))
+#define PROFILE_PIXEL_BEGIN() ((void)0)
+#define PROFILE_PIXEL_END(x, y) ((void)(x), (void)(y))
+#endif
+
+// counts of the running thread, flushed into frameRays after every tile
+RayCounts frameRays;
+std::mutex frameRaysMutex;
+
+void flushRayCounts()
+{
+	std::lock_guard<std::mutex> lock(frameRaysMutex);
+	frameRays.primary += threadRays.primary;
+	frameRays.shadow += threadRays.shadow;
+	frameRays.reflection += threadRays.reflection;
+	frameRays.nodeTests += threadRays.nodeTests;
+	frameRays.primitiveTests += threadRays.primitiveTests;
+	threadRays = RayCounts();
+#if RT_PROFILE
+	for (int d = 0; d < 2; ++d) {
+		for (int s = 0; s < STAGE_COUNT; ++s) {
+			frameProfile.cycles[d][s] += threadProfile.cycles[d][s];
+			frameProfile.calls[d][s] += threadProfile.calls[d][s];
+		}
+	}
+	frameProfile.pixelCycles += threadProfile.pixelCycles;
+	threadProfile = StageProfile();
+#endif
+}
+
+// sphere that last blocked a shadow ray towards each light cluster, per thread (-1: none)
+thread_local std::vector<int> lastOccluder;
+
+// visibility of the samples of the light cluster being shaded (-1: not traced yet), per thread
+thread_local std::vector<signed char> sampleVisibility;
+
+// shadow ray query. Neighbouring shadow rays towards one light cluster are usually blocked by the same sphere
+// (often the shaded sphere itself), so the last blocker is tested before the BVH is traversed.
+bool shadowBlocked(const Scene &scene, const Vector3f &rayOrigin, const Vector3f &rayDirection, float error, int cluster)
+{
+	threadRays.shadow++;
+	if (!options.occluderCache) {
+		int occluder;
+		return scene.occluded(rayOrigin, rayDirection, error, occluder);
+	}
+
+	if (lastOccluder.size() != scene.lights.size()) lastOccluder.assign(scene.lights.size(), -1);
+	int &cached = lastOccluder[cluster];
+	if (cached >= 0 && cached < (int)scene.spheres.size() && scene.occludedBy(cached, rayOrigin, rayDirection, error)) {
+		return true;
+	}
+
+	int occluder;
+	if (!scene.occluded(rayOrigin, rayDirection, error, occluder)) return false;
+	cached = occluder;
+	return true;
+}
+
+// random numbers for Russian roulette, seeded per camera sample so that renders are repeatable
+thread_local std::minstd_rand pathRandom;
+
+unsigned pathSeed(unsigned x, unsigned y, int sample)
+{
+	unsigned h = x * 73856093u ^ y * 19349663u ^ (unsigned)sample * 83492791u;
+	return h % 2147483646u + 1;
+}
+
+void seedPath(unsigned x, unsigned y, int sample)
+{
+	pathRandom.seed(pathSeed(x, y, sample));
+}
+
+// true if some value in [lo, hi] (per channel) is written to a different 8-bit PPM value than lo, after the
+// --gamma curve as quantize() applies it. The interval is widened a little to cover rounding differences
+// between this estimate and trace().
+bool mayChangeOutput(const Vector3f &lo, const Vector3f &hi)
+{
+	const float margin = 1e-4f;
+	for (int c = 0; c < 3; ++c) {
+		float a = std::max(0.f, lo(c) - margin);
+		float b = std::max(0.f, hi(c) + margin);
+		if (options.gamma != 1.f) {
+			// the curve is steepest near black, where a linear step far below 1/255 can still change the pixel
+			a = std::pow(a, 1.f / options.gamma);
+			b = std::pow(b, 1.f / options.gamma);
+		}
+		if ((int)(std::min(1.f, a) * 255) != (int)(std::min(1.f, b) * 255)) return true;
+	}
+	return false;
+}
+
+// number of shadow samples taken from a light cluster
+int lightSampleCount(const std::vector<Vector3f> &cluster)
+{
+	int samples = (int)cluster.size();
+	if (options.lightSamples > 0) samples = std::min(samples, (int)options.lightSamples);
+	return samples;
+}
+
+// light position of shadow sample s out of `samples`. The cluster is split into `samples` runs of points and
+// the sample takes one point of its run, picked by a hash of the shaded point: with fewer samples than
+// points the choice differs from pixel to pixel, so undersampled shadows are noisy instead of banded, and
+// the noise is deterministic. With every point sampled each run is a single point.
+const Vector3f &lightSample(const std::vector<Vector3f> &cluster, int s, int samples, const Vector3f &hitPoint)
+{
+	size_t begin = s * cluster.size() / samples;
+	size_t end = (s + 1) * cluster.size() / samples;
+	if (end - begin <= 1) return cluster[begin];
+
+	return cluster[begin + pointHash(hitPoint, (uint32_t)s) % (end - begin)];
+}
+
+// a light cluster evaluated at a hit, and the factor on its contribution
+struct LightChoice
+{
+	int cluster;
+	float weight;
+};
+
+// the light clusters evaluated at a hit: all of them, those left by --light-cull, or --light-tree
+// clusters picked by the light tree. Picked clusters are weighted by 1 / (picks * pdf), so the sum stays
+// an unbiased estimate of the sum over every cluster. The picks are driven by a hash of the hit point.
+void chooseLights(const Scene &scene, const Vector3f &hitPoint, const Vector3f &N, const Vector3f &V, const Vector3f &surfaceColor, std::vector<LightChoice> &choices)
+{
+	choices.clear();
+	if (options.lightTreeSamples == 0 && options.lightCull <= 0) {
+		for (int j = 0; j < (int)scene.lights.size(); ++j) choices.push_back(LightChoice{ j, 1.f });
+		return;
+	}
+
+	Vector3f mirrorV = 2 * N * N.dot(V) - V;
+	float albedo = surfaceColor.maxCoeff();
+	if (options.lightTreeSamples == 0) {
+		scene.lightTree.collect(hitPoint, N, mirrorV, albedo, options.lightCull, [&](int j) { choices.push_back(LightChoice{ j, 1.f }); });
+		return;
+	}
+	int picks = (int)options.lightTreeSamples;
+	for (int k = 0; k < picks; ++k) {
+		float u = (pointHash(hitPoint, 0x4c494748u + k) >> 8) * (1.f / 16777216.f);
+		float pdf;
+		int j = scene.lightTree.sample(hitPoint, N, mirrorV, albedo, options.lightCull, u, pdf);
+		if (j < 0) continue; // nothing can contribute along this pick
+		choices.push_back(LightChoice{ j, 1.f / (picks * pdf) });
+	}
+}
+
+// light clusters of the hit being shaded, per thread
+thread_local std::vector<LightChoice> lightChoices;
+
+// adds to `color` the Phong terms of the samples of light cluster j that are unblocked (visible[s] > 0) from
+// hitPoint, in sample order, each divided by the number of samples of the frame and scaled by `weight`.
+// Specialised on the specular exponent and on the cluster size, 0 standing for any size.
+typedef void (*ClusterShader)(const Scene &scene, int j, const signed char *visible, const Vector3f &surfaceColor,
+	const Vector3f &hitPoint, const Vector3f &N, const Vector3f &V, float weight, Vector3f &color);
+
+template <typename Specular, int Samples>
+void shadeCluster(const Scene &scene, int j, const signed char *visible, const Vector3f &surfaceColor,
+	const Vector3f &hitPoint, const Vector3f &N, const Vector3f &V, float weight, Vector3f &color)
+{
+	const std::vector<Vector3f> &cluster = scene.lights[j];
+	const int samples = Samples > 0 ? Samples : lightSampleCount(cluster);
+	const Specular specular(scene);
+	for (int s = 0; s < samples; ++s) {
+		if (visible[s] <= 0) continue;
+		Vector3f L = lightSample(cluster, s, samples, hitPoint) - hitPoint;
+		L.normalize();
+		color += weight * (phong(L, N, V, surfaceColor, Vector3f::Ones(), scene.kd, scene.ks, specular) / (scene.lights.size() * samples));
+	}
+}
+
+// shading kernel for a light cluster of the scene with `samples` samples. Single lights and clusters of the
+// default lights' size get kernels of their own.
+ClusterShader clusterShader(const Scene &scene, int samples)
+{
+	static const int DEFAULT_SAMPLES = 7;
+	static const ClusterShader kernels[SPECULAR_COUNT][3] = {
+		{ shadeCluster<NoSpecular, 0>, shadeCluster<NoSpecular, 1>, shadeCluster<NoSpecular, DEFAULT_SAMPLES> },
+		{ shadeCluster<DefaultSpecular, 0>, shadeCluster<DefaultSpecular, 1>, shadeCluster<DefaultSpecular, DEFAULT_SAMPLES> },
+		{ shadeCluster<IntegerSpecular, 0>, shadeCluster<IntegerSpecular, 1>, shadeCluster<IntegerSpecular, DEFAULT_SAMPLES> },
+		{ shadeCluster<RealSpecular, 0>, shadeCluster<RealSpecular, 1>, shadeCluster<RealSpecular, DEFAULT_SAMPLES> }
+	};
+	return kernels[scene.specularKind][samples == 1 ? 1 : samples == DEFAULT_SAMPLES ? 2 : 0];
+}
+
+// decides whether the reflection off a specular hit with direct light `pixelColor` is traced.
+// On return the child's prefix and weight are set, and `factor` is the blend weight of the reflected colour.
+bool continuePath(const Scene &scene, const Vector3f &prefix, float weight, const Vector3f &pixelColor, std::minstd_rand &random,
+	Vector3f &childPrefix, float &childWeight, float &factor)
+{
+	// the reflected colour ends up in the pixel as prefix + weight * 0.05 * reflected
+	childPrefix = prefix + weight * 0.95f * pixelColor;
+	childWeight = weight * 0.05f;
+	factor = 0.05f;
+	// light tree picks are weighted by 1 / (picks * pdf), which maxRadiance does not bound
+	if (options.termination == TERMINATE_CONTRIBUTION && !scene.floatOutput && !scene.averagedOutput && options.lightTreeSamples == 0) {
+		return mayChangeOutput(childPrefix, childPrefix + Vector3f::Constant(childWeight * scene.maxRadiance));
+	}
+	if (options.termination == TERMINATE_ROULETTE) {
+		// survive with a probability proportional to the largest possible contribution, in 8-bit steps
+		float survival = std::min(1.f, childWeight * scene.maxRadiance * 255.f);
+		if (!(std::uniform_real_distribution<float>(0.f, 1.f)(random) < survival)) return false;
+		if (survival < 1.f) {
+			factor = (float)(0.05 / survival);
+			childWeight /= survival;
+		}
+	}
+	return true;
+}
+
+// mirror direction of the ray about the normal
+Vector3f reflect(const Vector3f &rayDirection, const Vector3f &N)
+{
+	Vector3f L = -rayDirection;
+	L.normalize();
+	Vector3f R = 2 * N*(N.dot(L)) - L;
+	R.normalize();
+	return R;
+}
+
+// what a camera ray hits first, kept per pixel to guide the denoiser
+struct Features
+{
+	Vector3f normal = Vector3f::Zero(); // zero where the ray leaves the scene
+	Vector3f albedo = Vector3f::Zero();
+	float depth = 0;                    // distance along the ray
+};
+
+// features of the whole image while they are being recorded; tracePixels() fills them in
+std::vector<Features> primaryFeatures;
+unsigned primaryFeaturesWidth = 0;
+
+// sets the features of a camera ray that hits nothing
+void missFeatures(const Scene &scene, Features &features)
+{
+	features.normal = Vector3f::Zero();
+	features.albedo = scene.background;
+	features.depth = 1e6f;
+}
+
+// settles which of the samples of light cluster j are unblocked from hitPoint, as 1 or 0 in `visible`.
+// `depth` is the hit's bounce, for the stage profile.
+void clusterVisibility(const Scene &scene, int j, const Vector3f &hitPoint, int depth, std::vector<signed char> &visible)
+{
+	const std::vector<Vector3f> &cluster = scene.lights[j];
+	int samples = lightSampleCount(cluster);
+	float error = -0.1f;
+
+	// adaptive sampling: if the probes all agree the cluster is taken to be fully lit or fully
+	// blocked, and only penumbra points pay for the remaining shadow rays
+	visible.assign(samples, -1);
+	int probes = (int)options.lightProbes;
+	if (probes > 0 && probes < samples) {
+		int visibleProbes = 0;
+		for (int p = 0; p < probes; ++p) {
+			int s = p * samples / probes;
+			Vector3f rayDirection2 = lightSample(cluster, s, samples, hitPoint) - hitPoint;
+			rayDirection2.normalize();
+			PROFILE_STAGE(depth, STAGE_SHADOW);
+			visible[s] = !shadowBlocked(scene, hitPoint, rayDirection2, error, j);
+			visibleProbes += visible[s];
+		}
+		if (visibleProbes == 0 || visibleProbes == probes) {
+			for (int s = 0; s < samples; ++s) {
+				if (visible[s] < 0) visible[s] = visibleProbes > 0;
+			}
+			return;
+		}
+	}
+
+	for (int s = 0; s < samples; s++) {
+		if (visible[s] >= 0) continue;
+		Vector3f rayDirection2 = lightSample(cluster, s, samples, hitPoint) - hitPoint;
+		rayDirection2.normalize();
+		PROFILE_STAGE(depth, STAGE_SHADOW);
+		visible[s] = !shadowBlocked(scene, hitPoint, rayDirection2, error, j);
+	}
+}
+
+// direct light at a hit seen from direction V: the Phong terms of the unblocked samples of the chosen light
+// clusters. `depth` is the hit's bounce, for the stage profile.
+Vector3f directLight(const Scene &scene, const Vector3f &surfaceColor, const Vector3f &hitPoint, const Vector3f &N, const Vector3f &V, int depth)
+{
+	Vector3f pixelColor = Vector3f::Zero();
+	std::vector<LightChoice> &choices = lightChoices;
+	chooseLights(scene, hitPoint, N, V, surfaceColor, choices);
+	for (const LightChoice &choice : choices) {
+		int j = choice.cluster;
+		const std::vector<Vector3f> &cluster = scene.lights[j];
+		int samples = lightSampleCount(cluster);
+		std::vector<signed char> &visible = sampleVisibility;
+		clusterVisibility(scene, j, hitPoint, depth, visible);
+		PROFILE_STAGE(depth, STAGE_SHADE);
+		clusterShader(scene, samples)(scene, j, visible.data(), surfaceColor, hitPoint, N, V, choice.weight, pixelColor);
+	}
+	return pixelColor;
+}
+
+// `weight` is the factor between this ray's colour and the pixel colour, and `prefix` the part of the
+// pixel colour already gathered by the ray's ancestors; both are used to cut reflection paths short.
+// `features`, if given, receive the ray's first hit.
+Vector3f trace(
+	const Vector3f &rayOrigin,
+	const Vector3f &rayDirection,
+	const Scene &scene,
+	int depth,
+	float weight = 1.f,
+	const Vector3f &prefix = Vector3f::Zero(),
+	Features *features = nullptr)
+{
+	if (depth == 0) threadRays.primary++;
+	else threadRays.reflection++;
+
+	float error = -0.1f;
+	Hit hit;
+	Vector3f hitPoint, N;
+	{
+		PROFILE_STAGE(depth, STAGE_INTERSECT);
+		if (!scene.intersect(rayOrigin, rayDirection, error, hit)) {
+			if (features) missFeatures(scene, *features);
+			return scene.background;
+		}
+		hitPoint = rayOrigin + hit.t * rayDirection;
+		N = scene.normal(hit, hitPoint, rayDirection);
+	}
+	const Vector3f &surfaceColor = scene.surfaceColor(hit);
+	if (features) {
+		features->normal = N;
+		features->albedo = surfaceColor;
+		features->depth = hit.t;
+	}
+	Vector3f pixelColor = directLight(scene, surfaceColor, hitPoint, N, -rayDirection, depth);
+
+	if (++depth <= MAX_DEPTH) {
+		if (scene.specular(hit)) {
+			Vector3f childPrefix;
+			float childWeight, factor;
+			if (continuePath(scene, prefix, weight, pixelColor, pathRandom, childPrefix, childWeight, factor)) {
+				pixelColor = 0.95* pixelColor + factor * trace(hitPoint, reflect(rayDirection, N), scene, depth, childWeight, childPrefix);
+			}
+			else {
+				pixelColor = 0.95* pixelColor;
+			}
+		}
+	}
+
+	return pixelColor;
+}
+
+// fixed-size pool of worker threads with one task queue per worker.
+// A worker takes its own tasks from the front of its queue and, once that runs dry,
+// steals from the back of the other queues, so expensive tasks do not stall the rest.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned numThreads)
+	{
+		if (numThreads == 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 0; i < numThreads; ++i) queues.emplace_back(new Queue());
+		for (unsigned i = 0; i < numThreads; ++i) workers.emplace_back([this, i] { workerLoop(i); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread &worker : workers) worker.join();
+	}
+
+	// counts the queues, which are complete before any worker starts; workers is still growing then
+	unsigned size() const
+	{
+		return (unsigned)queues.size();
+	}
+
+	// runs task(i) for every i in [0, count) and returns when all of them have finished.
+	// The range is dealt out to the workers in contiguous blocks.
+	void parallelFor(int count, const std::function<void(int)> &task)
+	{
+		if (count <= 0) return;
+
+		Batch batch;
+		batch.task = &task;
+		batch.remaining = count;
+
+		pending += count;
+		unsigned n = size();
+		for (unsigned w = 0; w < n; ++w) {
+			Queue &queue = *queues[w];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			for (int i = (int)((long long)count * w / n); i < (int)((long long)count * (w + 1) / n); ++i) {
+				queue.items.push_back(Item{ &batch, i });
+			}
+		}
+		{
+			// a worker that saw pending == 0 is either already waiting or will see the new count
+			std::lock_guard<std::mutex> lock(mutex);
+		}
+		wake.notify_all();
+
+		std::unique_lock<std::mutex> lock(batch.mutex);
+		batch.done.wait(lock, [&] { return batch.remaining == 0; });
+	}
+
+private:
+	struct Batch
+	{
+		const std::function<void(int)> *task;
+		int remaining; // guarded by mutex
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+
+	struct Item
+	{
+		Batch *batch;
+		int index;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Item> items;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<int> pending{ 0 };
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stop = false;
+
+	bool pop(unsigned self, Item &item)
+	{
+		unsigned n = size();
+		for (unsigned k = 0; k < n; ++k) {
+			Queue &queue = *queues[(self + k) % n];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (queue.items.empty()) continue;
+			if (k == 0) {
+				item = queue.items.front();
+				queue.items.pop_front();
+			}
+			else {
+				item = queue.items.back();
+				queue.items.pop_back();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void workerLoop(unsigned self)
+	{
+		while (true) {
+			Item item;
+			if (pop(self, item)) {
+				--pending;
+				Batch &batch = *item.batch;
+				(*batch.task)(item.index);
+				// the waiter may return and destroy the batch as soon as it sees remaining == 0, so the
+				// last decrement and the notification both happen under the batch's lock
+				std::lock_guard<std::mutex> lock(batch.mutex);
+				if (--batch.remaining == 0) batch.done.notify_all();
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stop || pending > 0; });
+			if (stop && pending == 0) return;
+		}
+	}
+};
+
+// rectangle [x0, x1) x [y0, y1) of the image, in pixels
+struct Region
+{
+	unsigned x0, y0, x1, y1;
+
+	unsigned width() const
+	{
+		return x1 - x0;
+	}
+
+	unsigned height() const
+	{
+		return y1 - y0;
+	}
+
+	size_t area() const
+	{
+		return (size_t)width() * height();
+	}
+
+	// the region grown by n pixels on every side, clipped to a width x height image
+	Region expanded(unsigned n, unsigned imageWidth, unsigned imageHeight) const
+	{
+		return Region{ x0 > n ? x0 - n : 0, y0 > n ? y0 - n : 0, std::min(x1 + n, imageWidth), std::min(y1 + n, imageHeight) };
+	}
+};
+
+#if RT_PROFILE
+// adds the cycles of a camera sample to its pixel
+void recordPixel(unsigned x, unsigned y, unsigned long long cycles)
+{
+	threadProfile.pixelCycles += cycles;
+	if (!pixelCost.empty()) pixelCost[(size_t)y * pixelCostWidth + x] += (float)cycles;
+}
+#endif
+
+// interleaves the bits of x and y, below 1 << 16, with x in the even bits
+inline uint32_t morton2D(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v) {
+		v = (v | v << 8) & 0x00FF00FFu;
+		v = (v | v << 4) & 0x0F0F0F0Fu;
+		v = (v | v << 2) & 0x33333333u;
+		v = (v | v << 1) & 0x55555555u;
+		return v;
+	};
+	return spread(x) | spread(y) << 1;
+}
+
+// row-major indices of the cells of a width x height grid in Morton order, so that cells visited one after
+// the other are close together in both directions
+std::vector<unsigned> mortonOrder(unsigned width, unsigned height)
+{
+	std::vector<std::pair<uint32_t, unsigned>> codes;
+	codes.reserve((size_t)width * height);
+	for (unsigned y = 0; y < height; ++y) {
+		for (unsigned x = 0; x < width; ++x) codes.push_back(std::make_pair(morton2D(x, y), y * width + x));
+	}
+	std::sort(codes.begin(), codes.end());
+	std::vector<unsigned> order(codes.size());
+	for (size_t i = 0; i < codes.size(); ++i) order[i] = codes[i].second;
+	return order;
+}
+
+// runs tile(x0, y0, x1, y1) on the pool for every tile of the region, in image coordinates. With --morton
+// the tiles go out in Morton order, so that each worker's share of them is a compact block.
+template <typename Tile>
+void parallelTiles(const Region &region, ThreadPool &pool, Tile tile)
+{
+	unsigned tileSize = std::max(1u, options.tileSize);
+	unsigned tilesX = (region.width() + tileSize - 1) / tileSize;
+	unsigned tilesY = (region.height() + tileSize - 1) / tileSize;
+	std::vector<unsigned> order;
+	if (options.mortonOrder) order = mortonOrder(tilesX, tilesY);
+
+	pool.parallelFor(tilesX * tilesY, [&](int index) {
+		if (!order.empty()) index = order[index];
+		unsigned x0 = region.x0 + (index % tilesX) * tileSize;
+		unsigned y0 = region.y0 + (index / tilesX) * tileSize;
+		tile(x0, y0, std::min(x0 + tileSize, region.x1), std::min(y0 + tileSize, region.y1));
+		flushRayCounts();
+	});
+}
+
+// sub-pixel position of camera sample i: sample 0 is the pixel centre, the rest follow the
+// R2 low-discrepancy sequence so any prefix of the samples covers the pixel evenly
+void samplePosition(int i, float &sx, float &sy)
+{
+	const double g = 1.32471795724474602596; // plastic number
+	sx = (float)std::fmod(0.5 + i / g, 1.0);
+	sy = (float)std::fmod(0.5 + i / (g * g), 1.0);
+}
+
+// colour of pixel (x, y) after adaptive supersampling; centre(x, y) returns the centre sample of a pixel,
+// and is called for the pixel and its neighbours inside the image
+template <typename Centre>
+Vector3f refinePixel(const Scene &scene, unsigned x, unsigned y, Centre centre)
+{
+	const Camera &camera = scene.camera;
+	int maxSamples = (int)options.aaMaxSamples;
+	float threshold = options.aaThreshold;
+	const int batch = 4;
+
+	const Vector3f &center = centre(x, y);
+	float contrast = 0;
+	if (x > 0) contrast = std::max(contrast, (centre(x - 1, y) - center).cwiseAbs().maxCoeff());
+	if (x + 1 < camera.width) contrast = std::max(contrast, (centre(x + 1, y) - center).cwiseAbs().maxCoeff());
+	if (y > 0) contrast = std::max(contrast, (centre(x, y - 1) - center).cwiseAbs().maxCoeff());
+	if (y + 1 < camera.height) contrast = std::max(contrast, (centre(x, y + 1) - center).cwiseAbs().maxCoeff());
+	if (contrast <= threshold) return center;
+
+	Vector3f sum = center;
+	Vector3f lo = center;
+	Vector3f hi = center;
+	int n = 1;
+	while (n < maxSamples) {
+		int end = std::min(n + batch, maxSamples);
+		for (; n < end; ++n) {
+			float sx, sy;
+			samplePosition(n, sx, sy);
+			seedPath(x, y, n);
+			PROFILE_PIXEL_BEGIN();
+			Vector3f c = trace(camera.position, camera.rayDirection(x + sx, y + sy), scene, 0);
+			PROFILE_PIXEL_END(x, y);
+			sum += c;
+			lo = lo.cwiseMin(c);
+			hi = hi.cwiseMax(c);
+		}
+		if ((hi - lo).maxCoeff() <= threshold) break;
+	}
+	return sum / float(n);
+}
+
+// adaptive supersampling: pixels that differ from a neighbour by more than the threshold get batches of
+// extra samples until the samples agree or aaMaxSamples is reached. `first` holds the centre samples of
+// `halo`, which must contain the region and its neighbours inside the image; the result goes to `image`,
+// laid out over the region.
+void refinePixels(const Scene &scene, const std::vector<Vector3f> &first, const Region &halo, Vector3f *image, const Region &region, ThreadPool &pool)
+{
+	auto centre = [&](unsigned x, unsigned y) -> const Vector3f & { return first[(y - halo.y0) * halo.width() + (x - halo.x0)]; };
+
+	parallelTiles(region, pool, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+		for (unsigned y = y0; y < y1; ++y) {
+			for (unsigned x = x0; x < x1; ++x) {
+				image[(y - region.y0) * region.width() + (x - region.x0)] = refinePixel(scene, x, y, centre);
+			}
+		}
+	});
+}
+
+// pixel colour of a path that was shaded bounce by bounce, folded from the last bounce back to the camera like
+// the recursion in trace(): color holds the direct light of each of the `bounces` hits, factor the blend
+// weight of the reflection after it (0 if the path ends there) and blended whether its direct light is
+// scaled by 0.95. `missed` means the last ray left the scene.
+Vector3f foldPath(const Scene &scene, const Vector3f *color, const float *factor, const bool *blended, int bounces, bool missed)
+{
+	int last = bounces;
+	Vector3f result = scene.background;
+	if (!missed) {
+		--last;
+		result = blended[last] ? Vector3f(0.95* color[last]) : color[last];
+	}
+	for (int k = last - 1; k >= 0; --k) {
+		result = 0.95* color[k] + factor[k] * result;
+	}
+	return result;
+}
+
+// Wavefront engine: the same computation as trace(), but iterative and stage by stage. A batch of paths is
+// intersected, all of their shadow rays are queued and traced, the hits are shaded, and the surviving
+// reflection rays are compacted into the next queue. Each path keeps the direct light of every bounce and
+// folds them back to front at the end, in the same order as the recursion, so pixels match trace() exactly.
+class Wavefront
+{
+public:
+	Wavefront(const Scene &scene, ThreadPool &pool) : scene(scene), pool(pool)
+	{
+		totalSamples = 0;
+		for (const std::vector<Vector3f> &cluster : scene.lights) {
+			clusterOffset.push_back(totalSamples);
+			totalSamples += lightSampleCount(cluster);
+		}
+	}
+
+	// traces the pixel centres of the region into `image`, laid out over the region
+	void render(const Region &region, Vector3f *image)
+	{
+		const Camera &camera = scene.camera;
+		int pixels = (int)region.area();
+		int batchSize = (int)std::max(1u, options.wavefrontSize);
+		// with --morton the batches are compact blocks of the region instead of bands of rows
+		std::vector<unsigned> order;
+		if (options.mortonOrder) order = mortonOrder(region.width(), region.height());
+		for (int first = 0; first < pixels; first += batchSize) {
+			int count = std::min(batchSize, pixels - first);
+			paths.resize(count);
+			queue.resize(count);
+			forChunks(count, [&](int begin, int end) {
+				for (int i = begin; i < end; ++i) {
+					int pixel = order.empty() ? first + i : (int)order[first + i];
+					unsigned x = region.x0 + pixel % region.width();
+					unsigned y = region.y0 + pixel / region.width();
+					Path &path = paths[i];
+					path.pixel = pixel;
+					path.bounces = 0;
+					path.missed = false;
+					path.weight = 1.f;
+					path.prefix = Vector3f::Zero();
+					path.random.seed(pathSeed(x, y, 0));
+					path.origin = camera.position;
+					path.direction = camera.rayDirection(x + 0.5f, y + 0.5f);
+					path.features = primaryFeatures.empty() ? nullptr : &primaryFeatures[(size_t)y * primaryFeaturesWidth + x];
+					queue[i] = i;
+				}
+			});
+
+			for (int depth = 0; !queue.empty(); ++depth) {
+				intersect(depth);
+				traceShadows();
+				shade();
+				extend(depth);
+			}
+
+			forChunks(count, [&](int begin, int end) {
+				for (int i = begin; i < end; ++i) image[paths[i].pixel] = resolve(paths[i]);
+			});
+		}
+	}
+
+private:
+	// one camera sample and its chain of reflections
+	struct Path
+	{
+		Vector3f origin, direction; // current ray
+		Vector3f prefix;            // as in trace()
+		float weight;
+		std::minstd_rand random;
+		int pixel;                  // index into the output buffer
+		int bounces;                // hits recorded in color/factor
+		bool missed;                // the last ray left the scene
+		Hit hit;                    // hit of the current ray
+		Vector3f hitPoint, normal;
+		Vector3f color[MAX_DEPTH + 1]; // direct light at each hit
+		float factor[MAX_DEPTH + 1];   // blend weight of the reflection after each hit, 0 if it ends there
+		bool blended[MAX_DEPTH + 1];   // whether the hit's direct light is scaled by 0.95
+		Features *features;            // receive the camera ray's hit, if recorded
+	};
+
+	// one shadow ray: path slot and light sample of the path's current hit
+	struct ShadowRay
+	{
+		int path;
+		int cluster;
+		int sample;
+	};
+
+	const Scene &scene;
+	ThreadPool &pool;
+	int totalSamples;
+	std::vector<int> clusterOffset; // first visibility slot of each cluster
+	std::vector<Path> paths;
+	std::vector<int> queue;         // active paths
+	std::vector<ShadowRay> shadowRays;
+	std::vector<signed char> visibility; // per active path and light sample: -1 untraced, 0 blocked, 1 visible
+
+	template <typename Chunk>
+	void forChunks(int count, Chunk chunk)
+	{
+		const int chunkSize = 1024;
+		pool.parallelFor((count + chunkSize - 1) / chunkSize, [&](int c) {
+			chunk(c * chunkSize, std::min(count, (c + 1) * chunkSize));
+			flushRayCounts();
+		});
+	}
+
+	// closest hits of all queued rays; paths that leave the scene are finished and dropped from the queue
+	void intersect(int depth)
+	{
+		int count = (int)queue.size();
+		std::vector<char> alive(count);
+		forChunks(count, [&](int begin, int end) {
+			for (int q = begin; q < end; ++q) {
+				Path &path = paths[queue[q]];
+				if (depth == 0) threadRays.primary++;
+				else threadRays.reflection++;
+
+				alive[q] = scene.intersect(path.origin, path.direction, -0.1f, path.hit);
+				Features *features = depth == 0 ? path.features : nullptr;
+				if (!alive[q]) {
+					path.missed = true;
+					if (features) missFeatures(scene, *features);
+					continue;
+				}
+				path.hitPoint = path.origin + path.hit.t * path.direction;
+				path.normal = scene.normal(path.hit, path.hitPoint, path.direction);
+				if (features) {
+					features->normal = path.normal;
+					features->albedo = scene.surfaceColor(path.hit);
+					features->depth = path.hit.t;
+				}
+			}
+		});
+		compact(alive);
+	}
+
+	// all shadow rays of the current hits; with light probes the probes go first, as a batch of their own
+	void traceShadows()
+	{
+		int count = (int)queue.size();
+		visibility.assign((size_t)count * totalSamples, -1);
+
+		int probes = (int)options.lightProbes;
+		shadowRays.clear();
+		for (int q = 0; q < count; ++q) {
+			for (int j = 0; j < (int)scene.lights.size(); ++j) {
+				int samples = lightSampleCount(scene.lights[j]);
+				if (probes > 0 && probes < samples) {
+					for (int p = 0; p < probes; ++p) shadowRays.push_back(ShadowRay{ q, j, p * samples / probes });
+				}
+				else {
+					for (int s = 0; s < samples; ++s) shadowRays.push_back(ShadowRay{ q, j, s });
+				}
+			}
+		}
+		traceShadowBatch();
+		if (probes <= 0) return;
+
+		// the clusters whose probes disagree get the rest of their samples traced, the others are settled
+		shadowRays.clear();
+		for (int q = 0; q < count; ++q) {
+			for (int j = 0; j < (int)scene.lights.size(); ++j) {
+				int samples = lightSampleCount(scene.lights[j]);
+				if (probes >= samples) continue;
+				signed char *visible = &visibility[(size_t)q * totalSamples + clusterOffset[j]];
+				int visibleProbes = 0;
+				for (int p = 0; p < probes; ++p) visibleProbes += visible[p * samples / probes];
+				for (int s = 0; s < samples; ++s) {
+					if (visible[s] >= 0) continue;
+					if (visibleProbes == 0) visible[s] = 0;
+					else if (visibleProbes == probes) visible[s] = 1;
+					else shadowRays.push_back(ShadowRay{ q, j, s });
+				}
+			}
+		}
+		traceShadowBatch();
+	}
+
+	void traceShadowBatch()
+	{
+		if (options.sortRays) {
+			// the rays towards one light from nearby points take the same way through the BVH
+			AABB bounds;
+			for (int q : queue) bounds.grow(paths[q].hitPoint);
+			std::vector<unsigned> keys(shadowRays.size());
+			forChunks((int)shadowRays.size(), [&](int begin, int end) {
+				for (int r = begin; r < end; ++r) {
+					const ShadowRay &ray = shadowRays[r];
+					const Vector3f &origin = paths[queue[ray.path]].hitPoint;
+					const std::vector<Vector3f> &cluster = scene.lights[ray.cluster];
+					keys[r] = rayKey(origin, lightSample(cluster, ray.sample, lightSampleCount(cluster), origin) - origin, bounds);
+				}
+			});
+			sortByKey(shadowRays, keys);
+		}
+
+		forChunks((int)shadowRays.size(), [&](int begin, int end) {
+			for (int r = begin; r < end; ++r) {
+				const ShadowRay &ray = shadowRays[r];
+				const Path &path = paths[queue[ray.path]];
+				const std::vector<Vector3f> &cluster = scene.lights[ray.cluster];
+				Vector3f direction = lightSample(cluster, ray.sample, lightSampleCount(cluster), path.hitPoint) - path.hitPoint;
+				direction.normalize();
+				visibility[(size_t)ray.path * totalSamples + clusterOffset[ray.cluster] + ray.sample] =
+					!shadowBlocked(scene, path.hitPoint, direction, -0.1f, ray.cluster);
+			}
+		});
+	}
+
+	// direct light of every current hit, summed in the same order as trace()
+	void shade()
+	{
+		forChunks((int)queue.size(), [&](int begin, int end) {
+			for (int q = begin; q < end; ++q) {
+				Path &path = paths[queue[q]];
+				const Vector3f &surfaceColor = scene.surfaceColor(path.hit);
+				Vector3f V = -path.direction;
+				Vector3f pixelColor = Vector3f::Zero();
+				for (int j = 0; j < (int)scene.lights.size(); ++j) {
+					const std::vector<Vector3f> &cluster = scene.lights[j];
+					int samples = lightSampleCount(cluster);
+					const signed char *visible = &visibility[(size_t)q * totalSamples + clusterOffset[j]];
+					clusterShader(scene, samples)(scene, j, visible, surfaceColor, path.hitPoint, path.normal, V, 1.f, pixelColor);
+				}
+				path.color[path.bounces] = pixelColor;
+				path.factor[path.bounces] = 0.f;
+				path.blended[path.bounces] = false;
+			}
+		});
+	}
+
+	// spawns the reflection rays that are still worth tracing and compacts them into the next queue
+	void extend(int depth)
+	{
+		int count = (int)queue.size();
+		std::vector<char> alive(count);
+		forChunks(count, [&](int begin, int end) {
+			for (int q = begin; q < end; ++q) {
+				Path &path = paths[queue[q]];
+				int bounce = path.bounces++;
+				alive[q] = false;
+				if (depth + 1 > MAX_DEPTH || !scene.specular(path.hit)) continue;
+
+				path.blended[bounce] = true;
+				Vector3f childPrefix;
+				float childWeight, factor;
+				if (!continuePath(scene, path.prefix, path.weight, path.color[bounce], path.random, childPrefix, childWeight, factor)) continue;
+
+				path.factor[bounce] = factor;
+				path.prefix = childPrefix;
+				path.weight = childWeight;
+				path.direction = reflect(path.direction, path.normal);
+				path.origin = path.hitPoint;
+				alive[q] = true;
+			}
+		});
+		compact(alive);
+
+		if (options.sortRays) {
+			AABB bounds;
+			for (int q : queue) bounds.grow(paths[q].origin);
+			std::vector<unsigned> keys(queue.size());
+			for (size_t q = 0; q < queue.size(); ++q) keys[q] = rayKey(paths[queue[q]].origin, paths[queue[q]].direction, bounds);
+			sortByKey(queue, keys);
+		}
+	}
+
+	// coherence key of a ray for --sort-rays: the octant of its direction above the Morton code of its
+	// origin's cell in a 16 x 16 x 16 grid over `bounds`, 15 bits in all
+	static unsigned rayKey(const Vector3f &origin, const Vector3f &direction, const AABB &bounds)
+	{
+		unsigned octant = (direction(0) < 0) | (direction(1) < 0) << 1 | (direction(2) < 0) << 2;
+		unsigned code = 0;
+		for (int a = 0; a < 3; ++a) {
+			float extent = bounds.max(a) - bounds.min(a);
+			unsigned cell = extent > 0 ? (unsigned)std::min(15.f, std::max(0.f, (origin(a) - bounds.min(a)) / extent * 16)) : 0;
+			for (int bit = 0; bit < 4; ++bit) code |= (cell >> bit & 1) << (3 * bit + a);
+		}
+		return octant << 12 | code;
+	}
+
+	// reorders `items` by their rayKey() keys, keeping the order of equal keys: a counting sort, linear in
+	// the number of rays
+	template <typename T>
+	static void sortByKey(std::vector<T> &items, const std::vector<unsigned> &keys)
+	{
+		const unsigned bins = 1 << 15;
+		std::vector<unsigned> start(bins + 1, 0);
+		for (unsigned key : keys) start[key + 1]++;
+		for (unsigned b = 0; b < bins; ++b) start[b + 1] += start[b];
+		std::vector<T> sorted(items.size());
+		for (size_t i = 0; i < items.size(); ++i) sorted[start[keys[i]]++] = items[i];
+		items.swap(sorted);
+	}
+
+	void compact(const std::vector<char> &alive)
+	{
+		size_t n = 0;
+		for (size_t q = 0; q < queue.size(); ++q) {
+			if (alive[q]) queue[n++] = queue[q];
+		}
+		queue.resize(n);
+	}
+
+	Vector3f resolve(const Path &path) const
+	{
+		return foldPath(scene, path.color, path.factor, path.blended, path.bounces, path.missed);
+	}
+};
+
+// traces the pixel centres of `tile` on the calling thread into `image`, laid out over `layout`; in Morton
+// order with --morton
+void tracePixels(const Scene &scene, const Region &tile, Vector3f *image, const Region &layout)
+{
+	const Camera &camera = scene.camera;
+	auto tracePixel = [&](unsigned x, unsigned y) {
+		seedPath(x, y, 0);
+		Features *features = primaryFeatures.empty() ? nullptr : &primaryFeatures[(size_t)y * primaryFeaturesWidth + x];
+		PROFILE_PIXEL_BEGIN();
+		image[(y - layout.y0) * layout.width() + (x - layout.x0)] = trace(camera.position, camera.rayDirection(x + 0.5f, y + 0.5f), scene, 0, 1.f, Vector3f::Zero(), features);
+		PROFILE_PIXEL_END(x, y);
+	};
+
+	// Trace rays
+	if (options.mortonOrder) {
+		// tiles mostly share a size, so the order is kept from one tile to the next
+		static thread_local std::vector<unsigned> order;
+		static thread_local unsigned orderWidth = 0, orderHeight = 0;
+		if (orderWidth != tile.width() || orderHeight != tile.height()) {
+			orderWidth = tile.width();
+			orderHeight = tile.height();
+			order = mortonOrder(orderWidth, orderHeight);
+		}
+		for (unsigned index : order) tracePixel(tile.x0 + index % orderWidth, tile.y0 + index / orderWidth);
+		return;
+	}
+	for (unsigned y = tile.y0; y < tile.y1; ++y)
+	{
+		for (unsigned x = tile.x0; x < tile.x1; ++x)
+		{
+			tracePixel(x, y);
+		}
+	}
+}
+
+// traces the pixel centres of the region into `image`, laid out over the region
+void traceCentres(const Scene &scene, const Region &region, Vector3f *image, ThreadPool &pool)
+{
+	if (options.wavefront) {
+		Wavefront(scene, pool).render(region, image);
+		return;
+	}
+
+	parallelTiles(region, pool, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+		tracePixels(scene, Region{ x0, y0, x1, y1 }, image, region);
+	});
+}
+
+// renders a region of the image tile by tile on the pool. Every pixel is independent, so the result does not
+// depend on the thread count or on how the image is split into regions.
+void renderRegion(const Scene &scene, const Region &region, Vector3f *image, ThreadPool &pool)
+{
+	if (options.aaMaxSamples <= 1) {
+		traceCentres(scene, region, image, pool);
+		return;
+	}
+
+	// refinement compares every pixel with its neighbours, so the centre samples reach one pixel further
+	Region halo = region.expanded(1, scene.camera.width, scene.camera.height);
+	std::vector<Vector3f> first(halo.area());
+	traceCentres(scene, halo, first.data(), pool);
+	refinePixels(scene, first, halo, image, region, pool);
+}
+
+void renderImage(const Scene &scene, Vector3f *image, ThreadPool &pool)
+{
+	renderRegion(scene, Region{ 0, 0, scene.camera.width, scene.camera.height }, image, pool);
+}
+
+// renders one tile on the calling thread, with the same result as renderRegion()
+void renderTile(const Scene &scene, const Region &tile, Vector3f *image)
+{
+	if (options.aaMaxSamples <= 1) {
+		tracePixels(scene, tile, image, tile);
+		return;
+	}
+
+	// as in renderRegion(): the centre samples of the tile and of the pixels around it
+	static thread_local std::vector<Vector3f> first;
+	Region halo = tile.expanded(1, scene.camera.width, scene.camera.height);
+	first.resize(halo.area());
+	tracePixels(scene, halo, first.data(), halo);
+	auto centre = [&](unsigned x, unsigned y) -> const Vector3f & { return first[(y - halo.y0) * halo.width() + (x - halo.x0)]; };
+	for (unsigned y = tile.y0; y < tile.y1; ++y) {
+		for (unsigned x = tile.x0; x < tile.x1; ++x) {
+			image[(y - tile.y0) * tile.width() + (x - tile.x0)] = refinePixel(scene, x, y, centre);
+		}
+	}
+}
+
+// Denoiser: edge-aware a-trous wavelet filtering (Dammertz et al. 2010). Each iteration blurs the image
+// with a 5x5 B3-spline kernel whose taps lie `step` pixels apart, doubling the step every iteration, and
+// weights every tap by how much the neighbour resembles the centre pixel in colour, normal, depth and
+// albedo, so shadows and shading are smoothed within a surface but not across edges.
+//
+// The colour tolerance is scaled by the variance of the pixel's surroundings, as in SVGF (Schied et al.
+// 2017): undersampled penumbrae and highlights are noisy and get smoothed, while smooth shading and clean
+// shadows barely vary from pixel to pixel and are kept. One fixed tolerance has to choose between leaving
+// the noise and blurring everything else.
+//
+// The buffers are planar so that neighbouring pixels are filtered together with SSE or AVX2. The vector
+// kernels repeat the scalar arithmetic operation by operation, so every kernel gives the same image.
+
+// e^x for x <= 0, to about 2e-4 relative: 2^(x log2 e) is split into an integer power, built in the
+// exponent bits, and a polynomial for the fractional power
+inline float fastExp(float x)
+{
+	x = std::max(x * 1.44269504f, -126.f);
+	int i = (int)x;
+	if ((float)i > x) --i;
+	float f = x - (float)i;
+	float p = 1.f + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+	int32_t bits = (i + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+// planar image and features for the denoiser
+struct DenoisePlanes
+{
+	unsigned width = 0, height = 0;
+	std::vector<float> color[3];
+	std::vector<float> normal[3];
+	std::vector<float> albedo[3];
+	std::vector<float> depth;
+	std::vector<float> invVariance; // 1 / the luminance variance around the pixel, see estimateVariance()
+};
+
+// the tuning of the edge-stopping functions
+struct DenoiseParameters
+{
+	float colorWeight;  // 1 / sigma^2 of the colour difference at this iteration, in units of the local variance
+	float albedoWeight; // 1 / sigma^2 of the albedo difference
+	float depthWeight;  // 1 / sigma of the relative depth difference, scaled by the step
+};
+
+const float ATROUS_KERNEL[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+
+// weight of a neighbour from its squared colour and albedo distance, relative depth distance and the
+// dot product of the normals; colorWeight is the centre pixel's. The normal term is max(0, n.n')^256 by
+// repeated squaring.
+inline float tapWeight(float kernel, float colorDistance, float colorWeight, float albedoDistance, float depthDistance, float normalDot, const DenoiseParameters &parameters)
+{
+	float n = std::max(normalDot, 0.f);
+	for (int k = 0; k < 8; ++k) n = n * n;
+	float e = colorDistance * colorWeight + albedoDistance * parameters.albedoWeight + depthDistance * parameters.depthWeight;
+	return kernel * fastExp(-e) * n;
+}
+
+// filters pixels [x0, x1) of row y of `in` into `out`; neighbours outside the image are skipped
+void atrousScalar(const DenoisePlanes &in, DenoisePlanes &out, unsigned y, unsigned x0, unsigned x1, int step, const DenoiseParameters &parameters)
+{
+	int width = (int)in.width;
+	int height = (int)in.height;
+	for (unsigned x = x0; x < x1; ++x) {
+		size_t p = (size_t)y * width + x;
+		float cr = in.color[0][p], cg = in.color[1][p], cb = in.color[2][p];
+		float nx = in.normal[0][p], ny = in.normal[1][p], nz = in.normal[2][p];
+		float ar = in.albedo[0][p], ag = in.albedo[1][p], ab = in.albedo[2][p];
+		float z = in.depth[p];
+		float invDepth = 1.f / (z * (float)step);
+		float colorWeight = parameters.colorWeight * in.invVariance[p];
+		float center = ATROUS_KERNEL[2] * ATROUS_KERNEL[2];
+		float sumR = center * cr, sumG = center * cg, sumB = center * cb, sumW = center;
+		for (int dy = -2; dy <= 2; ++dy) {
+			int qy = (int)y + dy * step;
+			if (qy < 0 || qy >= height) continue;
+			for (int dx = -2; dx <= 2; ++dx) {
+				int qx = (int)x + dx * step;
+				if ((dx == 0 && dy == 0) || qx < 0 || qx >= width) continue;
+				size_t q = (size_t)qy * width + qx;
+				float dr = in.color[0][q] - cr, dg = in.color[1][q] - cg, db = in.color[2][q] - cb;
+				float er = in.albedo[0][q] - ar, eg = in.albedo[1][q] - ag, eb = in.albedo[2][q] - ab;
+				float dot = in.normal[0][q] * nx + (in.normal[1][q] * ny + in.normal[2][q] * nz);
+				float w = tapWeight(ATROUS_KERNEL[dy + 2] * ATROUS_KERNEL[dx + 2], dr * dr + (dg * dg + db * db), colorWeight, er * er + (eg * eg + eb * eb),
+					std::abs(in.depth[q] - z) * invDepth, dot, parameters);
+				sumR += w * in.color[0][q];
+				sumG += w * in.color[1][q];
+				sumB += w * in.color[2][q];
+				sumW += w;
+			}
+		}
+		out.color[0][p] = sumR / sumW;
+		out.color[1][p] = sumG / sumW;
+		out.color[2][p] = sumB / sumW;
+	}
+}
+
+#if defined(RT_X86)
+inline __m128 fastExpSSE(__m128 x)
+{
+	x = _mm_max_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504f)), _mm_set1_ps(-126.f));
+	__m128i i = _mm_cvttps_epi32(x);
+	// truncation rounds negative values up; step back to the floor where it did
+	__m128 above = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), x);
+	i = _mm_add_epi32(i, _mm_castps_si128(above));
+	__m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(i));
+	__m128 p = _mm_add_ps(_mm_set1_ps(0.00961813f), _mm_mul_ps(f, _mm_set1_ps(0.00133336f)));
+	p = _mm_add_ps(_mm_set1_ps(0.05550411f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.24022651f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.69314718f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(f, p));
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(p, scale);
+}
+
+// atrousScalar() for pixels [x0, x1) whose taps all lie inside the row range of the image, four at a time;
+// x1 - x0 must be a multiple of 4
+void atrousSSE(const DenoisePlanes &in, DenoisePlanes &out, unsigned y, unsigned x0, unsigned x1, int step, const DenoiseParameters &parameters)
+{
+	int width = (int)in.width;
+	int height = (int)in.height;
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	const __m128 colorScale = _mm_set1_ps(parameters.colorWeight);
+	const __m128 albedoWeight = _mm_set1_ps(parameters.albedoWeight);
+	const __m128 depthWeight = _mm_set1_ps(parameters.depthWeight);
+	for (unsigned x = x0; x < x1; x += 4) {
+		size_t p = (size_t)y * width + x;
+		__m128 cr = _mm_loadu_ps(&in.color[0][p]), cg = _mm_loadu_ps(&in.color[1][p]), cb = _mm_loadu_ps(&in.color[2][p]);
+		__m128 nx = _mm_loadu_ps(&in.normal[0][p]), ny = _mm_loadu_ps(&in.normal[1][p]), nz = _mm_loadu_ps(&in.normal[2][p]);
+		__m128 ar = _mm_loadu_ps(&in.albedo[0][p]), ag = _mm_loadu_ps(&in.albedo[1][p]), ab = _mm_loadu_ps(&in.albedo[2][p]);
+		__m128 z = _mm_loadu_ps(&in.depth[p]);
+		__m128 invDepth = _mm_div_ps(_mm_set1_ps(1.f), _mm_mul_ps(z, _mm_set1_ps((float)step)));
+		__m128 colorWeight = _mm_mul_ps(colorScale, _mm_loadu_ps(&in.invVariance[p]));
+		__m128 center = _mm_set1_ps(ATROUS_KERNEL[2] * ATROUS_KERNEL[2]);
+		__m128 sumR = _mm_mul_ps(center, cr), sumG = _mm_mul_ps(center, cg), sumB = _mm_mul_ps(center, cb), sumW = center;
+		for (int dy = -2; dy <= 2; ++dy) {
+			int qy = (int)y + dy * step;
+			if (qy < 0 || qy >= height) continue;
+			for (int dx = -2; dx <= 2; ++dx) {
+				if (dx == 0 && dy == 0) continue;
+				size_t q = (size_t)qy * width + x + dx * step;
+				__m128 qr = _mm_loadu_ps(&in.color[0][q]), qg = _mm_loadu_ps(&in.color[1][q]), qb = _mm_loadu_ps(&in.color[2][q]);
+				__m128 dr = _mm_sub_ps(qr, cr), dg = _mm_sub_ps(qg, cg), db = _mm_sub_ps(qb, cb);
+				__m128 er = _mm_sub_ps(_mm_loadu_ps(&in.albedo[0][q]), ar);
+				__m128 eg = _mm_sub_ps(_mm_loadu_ps(&in.albedo[1][q]), ag);
+				__m128 eb = _mm_sub_ps(_mm_loadu_ps(&in.albedo[2][q]), ab);
+				__m128 dot = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&in.normal[0][q]), nx),
+					_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&in.normal[1][q]), ny), _mm_mul_ps(_mm_loadu_ps(&in.normal[2][q]), nz)));
+				__m128 n = _mm_max_ps(dot, zero);
+				for (int k = 0; k < 8; ++k) n = _mm_mul_ps(n, n);
+				__m128 colorDistance = _mm_add_ps(_mm_mul_ps(dr, dr), _mm_add_ps(_mm_mul_ps(dg, dg), _mm_mul_ps(db, db)));
+				__m128 albedoDistance = _mm_add_ps(_mm_mul_ps(er, er), _mm_add_ps(_mm_mul_ps(eg, eg), _mm_mul_ps(eb, eb)));
+				__m128 depthDistance = _mm_mul_ps(_mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&in.depth[q]), z), absMask), invDepth);
+				__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(colorDistance, colorWeight), _mm_mul_ps(albedoDistance, albedoWeight)), _mm_mul_ps(depthDistance, depthWeight));
+				__m128 w = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(ATROUS_KERNEL[dy + 2] * ATROUS_KERNEL[dx + 2]), fastExpSSE(_mm_sub_ps(zero, e))), n);
+				sumR = _mm_add_ps(sumR, _mm_mul_ps(w, qr));
+				sumG = _mm_add_ps(sumG, _mm_mul_ps(w, qg));
+				sumB = _mm_add_ps(sumB, _mm_mul_ps(w, qb));
+				sumW = _mm_add_ps(sumW, w);
+			}
+		}
+		_mm_storeu_ps(&out.color[0][p], _mm_div_ps(sumR, sumW));
+		_mm_storeu_ps(&out.color[1][p], _mm_div_ps(sumG, sumW));
+		_mm_storeu_ps(&out.color[2][p], _mm_div_ps(sumB, sumW));
+	}
+}
+
+RT_TARGET_AVX2
+inline __m256 fastExpAVX2(__m256 x)
+{
+	x = _mm256_max_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(-126.f));
+	__m256i i = _mm256_cvttps_epi32(x);
+	__m256 above = _mm256_cmp_ps(_mm256_cvtepi32_ps(i), x, _CMP_GT_OQ);
+	i = _mm256_add_epi32(i, _mm256_castps_si256(above));
+	__m256 f = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+	__m256 p = _mm256_add_ps(_mm256_set1_ps(0.00961813f), _mm256_mul_ps(f, _mm256_set1_ps(0.00133336f)));
+	p = _mm256_add_ps(_mm256_set1_ps(0.05550411f), _mm256_mul_ps(f, p));
+	p = _mm256_add_ps(_mm256_set1_ps(0.24022651f), _mm256_mul_ps(f, p));
+	p = _mm256_add_ps(_mm256_set1_ps(0.69314718f), _mm256_mul_ps(f, p));
+	p = _mm256_add_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(f, p));
+	__m256 scale = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23));
+	return _mm256_mul_ps(p, scale);
+}
+
+// atrousSSE() eight pixels at a time; x1 - x0 must be a multiple of 8
+RT_TARGET_AVX2
+void atrousAVX2(const DenoisePlanes &in, DenoisePlanes &out, unsigned y, unsigned x0, unsigned x1, int step, const DenoiseParameters &parameters)
+{
+	int width = (int)in.width;
+	int height = (int)in.height;
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	const __m256 colorScale = _mm256_set1_ps(parameters.colorWeight);
+	const __m256 albedoWeight = _mm256_set1_ps(parameters.albedoWeight);
+	const __m256 depthWeight = _mm256_set1_ps(parameters.depthWeight);
+	for (unsigned x = x0; x < x1; x += 8) {
+		size_t p = (size_t)y * width + x;
+		__m256 cr = _mm256_loadu_ps(&in.color[0][p]), cg = _mm256_loadu_ps(&in.color[1][p]), cb = _mm256_loadu_ps(&in.color[2][p]);
+		__m256 nx = _mm256_loadu_ps(&in.normal[0][p]), ny = _mm256_loadu_ps(&in.normal[1][p]), nz = _mm256_loadu_ps(&in.normal[2][p]);
+		__m256 ar = _mm256_loadu_ps(&in.albedo[0][p]), ag = _mm256_loadu_ps(&in.albedo[1][p]), ab = _mm256_loadu_ps(&in.albedo[2][p]);
+		__m256 z = _mm256_loadu_ps(&in.depth[p]);
+		__m256 invDepth = _mm256_div_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(z, _mm256_set1_ps((float)step)));
+		__m256 colorWeight = _mm256_mul_ps(colorScale, _mm256_loadu_ps(&in.invVariance[p]));
+		__m256 center = _mm256_set1_ps(ATROUS_KERNEL[2] * ATROUS_KERNEL[2]);
+		__m256 sumR = _mm256_mul_ps(center, cr), sumG = _mm256_mul_ps(center, cg), sumB = _mm256_mul_ps(center, cb), sumW = center;
+		for (int dy = -2; dy <= 2; ++dy) {
+			int qy = (int)y + dy * step;
+			if (qy < 0 || qy >= height) continue;
+			for (int dx = -2; dx <= 2; ++dx) {
+				if (dx == 0 && dy == 0) continue;
+				size_t q = (size_t)qy * width + x + dx * step;
+				__m256 qr = _mm256_loadu_ps(&in.color[0][q]), qg = _mm256_loadu_ps(&in.color[1][q]), qb = _mm256_loadu_ps(&in.color[2][q]);
+				__m256 dr = _mm256_sub_ps(qr, cr), dg = _mm256_sub_ps(qg, cg), db = _mm256_sub_ps(qb, cb);
+				__m256 er = _mm256_sub_ps(_mm256_loadu_ps(&in.albedo[0][q]), ar);
+				__m256 eg = _mm256_sub_ps(_mm256_loadu_ps(&in.albedo[1][q]), ag);
+				__m256 eb = _mm256_sub_ps(_mm256_loadu_ps(&in.albedo[2][q]), ab);
+				__m256 dot = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&in.normal[0][q]), nx),
+					_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(&in.normal[1][q]), ny), _mm256_mul_ps(_mm256_loadu_ps(&in.normal[2][q]), nz)));
+				__m256 n = _mm256_max_ps(dot, zero);
+				for (int k = 0; k < 8; ++k) n = _mm256_mul_ps(n, n);
+				__m256 colorDistance = _mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_add_ps(_mm256_mul_ps(dg, dg), _mm256_mul_ps(db, db)));
+				__m256 albedoDistance = _mm256_add_ps(_mm256_mul_ps(er, er), _mm256_add_ps(_mm256_mul_ps(eg, eg), _mm256_mul_ps(eb, eb)));
+				__m256 depthDistance = _mm256_mul_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(&in.depth[q]), z), absMask), invDepth);
+				__m256 e = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(colorDistance, colorWeight), _mm256_mul_ps(albedoDistance, albedoWeight)), _mm256_mul_ps(depthDistance, depthWeight));
+				__m256 w = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(ATROUS_KERNEL[dy + 2] * ATROUS_KERNEL[dx + 2]), fastExpAVX2(_mm256_sub_ps(zero, e))), n);
+				sumR = _mm256_add_ps(sumR, _mm256_mul_ps(w, qr));
+				sumG = _mm256_add_ps(sumG, _mm256_mul_ps(w, qg));
+				sumB = _mm256_add_ps(sumB, _mm256_mul_ps(w, qb));
+				sumW = _mm256_add_ps(sumW, w);
+			}
+		}
+		_mm256_storeu_ps(&out.color[0][p], _mm256_div_ps(sumR, sumW));
+		_mm256_storeu_ps(&out.color[1][p], _mm256_div_ps(sumG, sumW));
+		_mm256_storeu_ps(&out.color[2][p], _mm256_div_ps(sumB, sumW));
+	}
+}
+#endif
+
+// sets planes.invVariance from the luminance variance over each pixel's 3x3 neighbours on the same surface
+// (normals within about 25 degrees). The variance has a floor, so that flat regions get a finite weight.
+void estimateVariance(DenoisePlanes &planes, ThreadPool &pool)
+{
+	const float VARIANCE_FLOOR = 1e-4f;
+	int width = (int)planes.width;
+	int height = (int)planes.height;
+	planes.invVariance.resize((size_t)width * height);
+	pool.parallelFor(height, [&](int y) {
+		for (int x = 0; x < width; ++x) {
+			size_t p = (size_t)y * width + x;
+			float count = 0, sum = 0, sumSquares = 0;
+			for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); ++qy) {
+				for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); ++qx) {
+					size_t q = (size_t)qy * width + qx;
+					float dot = planes.normal[0][q] * planes.normal[0][p] + planes.normal[1][q] * planes.normal[1][p] + planes.normal[2][q] * planes.normal[2][p];
+					if (q != p && dot < 0.9f) continue;
+					float luminance = (planes.color[0][q] + planes.color[1][q] + planes.color[2][q]) / 3;
+					count += 1;
+					sum += luminance;
+					sumSquares += luminance * luminance;
+				}
+			}
+			float mean = sum / count;
+			planes.invVariance[p] = 1.f / (std::max(sumSquares / count - mean * mean, 0.f) + VARIANCE_FLOOR);
+		}
+	});
+}
+
+// denoises `image` in place with the features recorded for it; rows are filtered in parallel on the pool
+void denoise(Vector3f *image, const std::vector<Features> &features, unsigned width, unsigned height, ThreadPool &pool, SimdLevel simd)
+{
+	size_t n = (size_t)width * height;
+	DenoisePlanes planes[2];
+	for (DenoisePlanes &buffer : planes) {
+		buffer.width = width;
+		buffer.height = height;
+		for (int c = 0; c < 3; ++c) buffer.color[c].resize(n);
+	}
+	DenoisePlanes &first = planes[0];
+	for (int c = 0; c < 3; ++c) {
+		first.normal[c].resize(n);
+		first.albedo[c].resize(n);
+	}
+	first.depth.resize(n);
+	for (size_t i = 0; i < n; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			first.color[c][i] = image[i](c);
+			first.normal[c][i] = features[i].normal(c);
+			first.albedo[c][i] = features[i].albedo(c);
+		}
+		first.depth[i] = features[i].depth;
+	}
+	estimateVariance(first, pool);
+	// the features are shared; only the colour ping-pongs between the two buffers
+	for (int c = 0; c < 3; ++c) {
+		planes[1].normal[c].swap(first.normal[c]);
+		planes[1].albedo[c].swap(first.albedo[c]);
+	}
+	planes[1].depth.swap(first.depth);
+	planes[1].invVariance.swap(first.invVariance);
+
+	// lanes of the vector kernel, 1 for scalar only
+	unsigned lanes = simd == SIMD_AVX2 ? 8 : simd == SIMD_SSE ? 4 : 1;
+#if !defined(RT_X86)
+	lanes = 1;
+#endif
+	int current = 0;
+	for (unsigned iteration = 0; iteration < options.denoiseIterations; ++iteration) {
+		int step = 1 << iteration;
+		DenoisePlanes &in = planes[current];
+		DenoisePlanes &out = planes[1 - current];
+		// move the features to the input side
+		for (int c = 0; c < 3; ++c) {
+			in.normal[c].swap(out.normal[c]);
+			in.albedo[c].swap(out.albedo[c]);
+		}
+		in.depth.swap(out.depth);
+		in.invVariance.swap(out.invVariance);
+
+		// the colour tolerance narrows as the filter widens: each iteration leaves less variance than the
+		// estimate of the noisy image, so later iterations only smooth out what is left
+		float sigma = options.denoiseSigma * std::pow(0.35f, (float)iteration);
+		DenoiseParameters parameters = { 1.f / (sigma * sigma), 1.f / (0.1f * 0.1f), 1.f / 0.01f };
+
+		// pixels whose taps stay inside the image horizontally can use the vector kernel
+		unsigned reach = 2 * step;
+		unsigned inner0 = std::min(reach, width);
+		unsigned inner1 = width > 2 * reach ? inner0 + (width - 2 * reach) / lanes * lanes : inner0;
+		pool.parallelFor((int)height, [&](int y) {
+#if defined(RT_X86)
+			// the weights of dissimilar neighbours underflow, and denormal arithmetic is many times slower;
+			// flushing them to zero changes the result by less than a float's precision
+			unsigned csr = _mm_getcsr();
+			_mm_setcsr(csr | 0x8040); // FTZ | DAZ
+			atrousScalar(in, out, y, 0, inner0, step, parameters);
+			if (lanes == 8) atrousAVX2(in, out, y, inner0, inner1, step, parameters);
+			else if (lanes == 4) atrousSSE(in, out, y, inner0, inner1, step, parameters);
+			else atrousScalar(in, out, y, inner0, inner1, step, parameters);
+			atrousScalar(in, out, y, inner1, width, step, parameters);
+			_mm_setcsr(csr);
+#else
+			atrousScalar(in, out, y, 0, width, step, parameters);
+#endif
+		});
+		current = 1 - current;
+	}
+
+	const DenoisePlanes &result = planes[current];
+	for (size_t i = 0; i < n; ++i) image[i] = Vector3f(result.color[0][i], result.color[1][i], result.color[2][i]);
+}
+
+// converts radiance to 8-bit values as the PPM output always has: clamped to 1 and truncated, after an
+// optional gamma curve. n is the number of floats.
+void quantize(const float *src, unsigned char *dst, size_t n, float gamma)
+{
+	std::vector<float> corrected;
+	if (gamma != 1.f) {
+		corrected.resize(n);
+		for (size_t i = 0; i < n; ++i) corrected[i] = std::pow(std::max(src[i], 0.f), 1.f / gamma);
+		src = corrected.data();
+	}
+
+	size_t i = 0;
+#if defined(RT_X86)
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 scale = _mm_set1_ps(255.f);
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i), one), zero), scale));
+		__m128i b = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i + 4), one), zero), scale));
+		__m128i c = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i + 8), one), zero), scale));
+		__m128i d = _mm_cvttps_epi32(_mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(src + i + 12), one), zero), scale));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+	}
+#endif
+	for (; i < n; ++i) dst[i] = (unsigned char)(std::max(std::min(float(1), src[i]), 0.f) * 255);
+}
+
+// true for a .pfm file name, which gets float radiance instead of 8-bit values
+bool isFloatImage(const std::string &path)
+{
+	return path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0;
+}
+
+// header of a PPM or PFM image file
+std::string imageHeader(unsigned width, unsigned height, bool pfm)
+{
+	std::ostringstream out;
+	if (pfm) out << "PF\n" << width << " " << height << "\n-1.0\n"; // negative scale: little-endian floats
+	else out << "P6\n" << width << " " << height << "\n255\n";
+	return out.str();
+}
+
+// the whole image as the file ImageWriter writes, in memory
+std::string encodeImage(const Vector3f *pixels, unsigned width, unsigned height, bool pfm, float gamma = options.gamma)
+{
+	std::string result = imageHeader(width, height, pfm);
+	size_t header = result.size();
+	size_t rowFloats = 3 * (size_t)width;
+	const float *src = pixels[0].data();
+	if (pfm) {
+		// PFM stores the rows bottom to top
+		result.resize(header + height * rowFloats * sizeof(float));
+		for (unsigned y = 0; y < height; ++y) {
+			std::memcpy(&result[header + (height - 1 - y) * rowFloats * sizeof(float)], src + y * rowFloats, rowFloats * sizeof(float));
+		}
+		return result;
+	}
+	result.resize(header + height * rowFloats);
+	quantize(src, (unsigned char *)&result[header], height * rowFloats, gamma);
+	return result;
+}
+
+// image file written band by band: PPM (8-bit, clamped) or, for a .pfm name, PFM with the unclamped
+// float radiance. Rows are written at their place in the file, so bands may come in any order.
+class ImageWriter
+{
+public:
+	bool open(const std::string &path, unsigned width, unsigned height, float gamma = options.gamma)
+	{
+		this->width = width;
+		this->height = height;
+		this->gamma = gamma;
+		pfm = isFloatImage(path);
+		out.open(path.c_str(), std::ios::out | std::ios::binary);
+		if (!out.is_open()) return false;
+		out << imageHeader(width, height, pfm);
+		headerSize = out.tellp();
+		return (bool)out;
+	}
+
+	// writes rows [y0, y0 + rows) from a buffer of whole rows
+	void writeRows(unsigned y0, unsigned rows, const Vector3f *pixels)
+	{
+		size_t rowFloats = 3 * (size_t)width;
+		const float *src = pixels[0].data();
+		if (pfm) {
+			// PFM stores the rows bottom to top
+			for (unsigned r = 0; r < rows; ++r) {
+				out.seekp(headerSize + (std::streamoff)(height - 1 - (y0 + r)) * rowFloats * sizeof(float));
+				out.write((const char *)(src + r * rowFloats), rowFloats * sizeof(float));
+			}
+			return;
+		}
+		bytes.resize(rows * rowFloats);
+		quantize(src, bytes.data(), bytes.size(), gamma);
+		out.seekp(headerSize + (std::streamoff)y0 * rowFloats);
+		out.write((const char *)bytes.data(), bytes.size());
+	}
+
+	bool close()
+	{
+		out.close();
+		return !out.fail();
+	}
+
+private:
+	std::ofstream out;
+	std::streamoff headerSize = 0;
+	unsigned width = 0, height = 0;
+	float gamma = 1.f;
+	bool pfm = false;
+	std::vector<unsigned char> bytes;
+};
+
+// colour ramp black - blue - red - yellow - white for t in [0, 1]
+Vector3f heatColor(float t)
+{
+	const Vector3f ramp[] = { Vector3f(0, 0, 0), Vector3f(0, 0, 1), Vector3f(1, 0, 0), Vector3f(1, 1, 0), Vector3f(1, 1, 1) };
+	float x = std::min(std::max(t, 0.f), 1.f) * 4;
+	int i = std::min((int)x, 3);
+	return ramp[i] + (x - i) * (ramp[i + 1] - ramp[i]);
+}
+
+// writes the per-pixel cost as an image: cycles in every channel for a .pfm name, else a colour ramp
+// scaled to the 99th percentile so that a few very expensive pixels do not wash out the rest
+bool writeHeatmap(const std::string &path, unsigned width, unsigned height)
+{
+	std::vector<Vector3f> image(pixelCost.size());
+	bool pfm = isFloatImage(path);
+	if (pfm) {
+		for (size_t i = 0; i < image.size(); ++i) image[i] = Vector3f::Constant(pixelCost[i]);
+	}
+	else {
+		std::vector<float> sorted(pixelCost);
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+		float scale = sorted[sorted.size() * 99 / 100];
+		if (scale <= 0) scale = 1;
+		for (size_t i = 0; i < image.size(); ++i) image[i] = heatColor(pixelCost[i] / scale);
+	}
+
+	ImageWriter writer;
+	if (!writer.open(path, width, height, 1.f)) return false;
+	writer.writeRows(0, height, image.data());
+	return writer.close();
+}
+
+// float radiance image kept in a file instead of in memory, for frames larger than RAM. The file holds
+// TILE x TILE tiles one after another, each a contiguous block, and a tile is mapped only while it is
+// rendered or read back, so resident memory stays at a few tiles per thread whatever the resolution.
+// The pages of finished tiles belong to the page cache, which writes them out and reclaims them.
+class TiledFramebuffer
+{
+public:
+	static const unsigned TILE = 64;
+
+	// a mapped tile: its pixels, row by row over tileRegion()
+	struct TileView
+	{
+		Vector3f *pixels = nullptr;
+		char *base = nullptr; // start of the mapping, rounded down to the mapping granularity
+		size_t length = 0;
+	};
+
+	TiledFramebuffer()
+	{
+	}
+
+	TiledFramebuffer(const TiledFramebuffer &) = delete;
+	TiledFramebuffer &operator=(const TiledFramebuffer &) = delete;
+
+	~TiledFramebuffer()
+	{
+#ifdef _WIN32
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (fd >= 0) close(fd);
+#endif
+	}
+
+	// creates (or truncates) the file at its full size; the file is sparse until tiles are written
+	bool create(const std::string &path, unsigned width, unsigned height)
+	{
+		this->width = width;
+		this->height = height;
+		tilesX = (width + TILE - 1) / TILE;
+		tilesY = (height + TILE - 1) / TILE;
+		unsigned long long size = (unsigned long long)tileCount() * TILE_BYTES;
+#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+		file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE) return false;
+		mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+		return mapping != NULL;
+#else
+		granularity = (size_t)sysconf(_SC_PAGESIZE);
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) return false;
+		return ftruncate(fd, (off_t)size) == 0;
+#endif
+	}
+
+	unsigned tileCount() const
+	{
+		return tilesX * tilesY;
+	}
+
+	// pixels covered by a tile; the tiles at the right and bottom edges are cut to the image
+	Region tileRegion(unsigned index) const
+	{
+		unsigned x0 = index % tilesX * TILE;
+		unsigned y0 = index / tilesX * TILE;
+		return Region{ x0, y0, std::min(x0 + TILE, width), std::min(y0 + TILE, height) };
+	}
+
+	// maps a tile for reading and writing; pixels is null if the mapping fails
+	TileView map(unsigned index) const
+	{
+		TileView view;
+		unsigned long long offset = (unsigned long long)index * TILE_BYTES;
+		unsigned long long start = offset / granularity * granularity;
+		size_t length = (size_t)(offset - start) + TILE_BYTES;
+#ifdef _WIN32
+		void *p = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, (DWORD)(start >> 32), (DWORD)start, length);
+		if (!p) return view;
+#else
+		void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)start);
+		if (p == MAP_FAILED) return view;
+#endif
+		view.base = (char *)p;
+		view.length = length;
+		view.pixels = (Vector3f *)(view.base + (offset - start));
+		return view;
+	}
+
+	void unmap(TileView &view) const
+	{
+		if (!view.base) return;
+#ifdef _WIN32
+		UnmapViewOfFile(view.base);
+#else
+		munmap(view.base, view.length);
+#endif
+		view = TileView();
+	}
+
+	// copies the image to a writer one row of tiles at a time
+	bool write(ImageWriter &writer) const
+	{
+		std::vector<Vector3f> band((size_t)width * TILE);
+		for (unsigned ty = 0; ty < tilesY; ++ty) {
+			unsigned y0 = ty * TILE;
+			unsigned rows = std::min(TILE, height - y0);
+			for (unsigned tx = 0; tx < tilesX; ++tx) {
+				unsigned index = ty * tilesX + tx;
+				Region tile = tileRegion(index);
+				TileView view = map(index);
+				if (!view.pixels) return false;
+				for (unsigned r = 0; r < rows; ++r) {
+					std::copy(view.pixels + r * tile.width(), view.pixels + (r + 1) * tile.width(), band.begin() + (size_t)r * width + tile.x0);
+				}
+				unmap(view);
+			}
+			writer.writeRows(y0, rows, band.data());
+		}
+		return true;
+	}
+
+private:
+	static const size_t TILE_BYTES = TILE * TILE * sizeof(Vector3f);
+
+	unsigned width = 0, height = 0;
+	unsigned tilesX = 0, tilesY = 0;
+	size_t granularity = 4096; // mapping offsets must be multiples of this
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+// renders the frame into a file-backed framebuffer, one mapped tile per task
+bool renderTiled(const Scene &scene, TiledFramebuffer &framebuffer, ThreadPool &pool)
+{
+	std::atomic<bool> ok(true);
+	pool.parallelFor(framebuffer.tileCount(), [&](int index) {
+		TiledFramebuffer::TileView view = framebuffer.map(index);
+		if (!view.pixels) {
+			ok = false;
+			return;
+		}
+		renderTile(scene, framebuffer.tileRegion(index), view.pixels);
+		framebuffer.unmap(view);
+		flushRayCounts();
+	});
+	return ok;
+}
+
+// Distributed rendering: the coordinator forks worker processes, which inherit the built scene, and talks
+// to each over a socket pair. It hands out tiles by index, keeping a few in flight per worker so the
+// workers never wait, and collects the pixels. A worker that dies or breaks the protocol is reaped and its
+// outstanding tiles go back to the queue for the others; every pixel is deterministic, so a retried tile
+// comes out the same.
+//
+// Messages, in host byte order: coordinator -> worker a uint32 tile index; worker -> coordinator the
+// uint32 tile index, the tile's pixels row by row and the RayCounts of the tile.
+
+// the framebuffer's tiles, so that a returned tile is stored with one mapping
+const unsigned DISTRIBUTED_TILE = TiledFramebuffer::TILE;
+
+// tile `index` of the DISTRIBUTED_TILE grid over the image, cut to the image
+Region distributedTile(unsigned index, unsigned width, unsigned height)
+{
+	unsigned tilesX = (width + DISTRIBUTED_TILE - 1) / DISTRIBUTED_TILE;
+	unsigned x0 = index % tilesX * DISTRIBUTED_TILE;
+	unsigned y0 = index / tilesX * DISTRIBUTED_TILE;
+	return Region{ x0, y0, std::min(x0 + DISTRIBUTED_TILE, width), std::min(y0 + DISTRIBUTED_TILE, height) };
+}
+
+#ifndef _WIN32
+bool readAll(int fd, void *data, size_t size)
+{
+	char *p = (char *)data;
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool writeAll(int fd, const void *data, size_t size)
+{
+	const char *p = (const char *)data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+// body of a worker process: renders the tiles it is sent until the coordinator closes the socket
+void workerLoop(const Scene &scene, int fd)
+{
+	std::vector<Vector3f> pixels(DISTRIBUTED_TILE * DISTRIBUTED_TILE);
+	uint32_t index;
+	threadRays = RayCounts();
+	while (readAll(fd, &index, sizeof(index))) {
+		Region tile = distributedTile(index, scene.camera.width, scene.camera.height);
+		renderTile(scene, tile, pixels.data());
+		RayCounts counts = threadRays;
+		threadRays = RayCounts();
+		if (!writeAll(fd, &index, sizeof(index)) || !writeAll(fd, pixels.data(), tile.area() * sizeof(Vector3f)) ||
+			!writeAll(fd, &counts, sizeof(counts))) return;
+	}
+}
+#endif
+
+// renders the frame in `workerCount` processes; store(index, tile, pixels) receives every tile once, on
+// the calling thread, with the pixels laid out over the tile. A worker that dies, or returns nothing for
+// --worker-timeout seconds, is killed and its tiles go to the others. Fails only if every worker is lost.
+bool renderDistributed(const Scene &scene, unsigned workerCount, const std::function<bool(unsigned, const Region &, const Vector3f *)> &store)
+{
+#ifdef _WIN32
+	std::cerr << "worker processes are not supported on Windows" << std::endl;
+	return false;
+#else
+	struct Worker
+	{
+		pid_t pid;
+		int fd;
+		std::deque<uint32_t> pending; // tiles sent and not yet returned, in order
+		std::chrono::steady_clock::time_point deadline; // for the first pending tile
+	};
+	const std::chrono::seconds timeout(options.workerTimeout);
+
+	unsigned width = scene.camera.width;
+	unsigned height = scene.camera.height;
+	unsigned tileCount = ((width + DISTRIBUTED_TILE - 1) / DISTRIBUTED_TILE) * ((height + DISTRIBUTED_TILE - 1) / DISTRIBUTED_TILE);
+
+	// a write to a dead worker must fail with EPIPE instead of killing the coordinator
+	void (*previousHandler)(int) = signal(SIGPIPE, SIG_IGN);
+
+	std::vector<Worker> workers;
+	for (unsigned i = 0; i < workerCount; ++i) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) break;
+		std::cout.flush();
+		pid_t pid = fork();
+		if (pid < 0) {
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			for (const Worker &worker : workers) close(worker.fd);
+			workerLoop(scene, fds[1]);
+			_exit(0);
+		}
+		close(fds[1]);
+		// a worker that stops half way through a tile must not block the reads either
+		timeval limit = { (time_t)options.workerTimeout, 0 };
+		setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+		setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+		workers.push_back(Worker{ pid, fds[0], std::deque<uint32_t>(), std::chrono::steady_clock::time_point() });
+	}
+
+	std::deque<uint32_t> queue;
+	for (uint32_t i = 0; i < tileCount; ++i) queue.push_back(i);
+
+	auto lose = [&](Worker &worker, const char *why) {
+		std::cerr << "worker " << worker.pid << " " << why << ", retrying its " << worker.pending.size() << " tiles" << std::endl;
+		queue.insert(queue.begin(), worker.pending.begin(), worker.pending.end());
+		worker.pending.clear();
+		close(worker.fd);
+		worker.fd = -1;
+		kill(worker.pid, SIGKILL);
+		waitpid(worker.pid, NULL, 0);
+	};
+
+	const size_t inFlight = 2;
+	std::vector<Vector3f> pixels(DISTRIBUTED_TILE * DISTRIBUTED_TILE);
+	unsigned done = 0;
+	bool failed = false;
+	while (!failed && done < tileCount) {
+		std::vector<pollfd> fds;
+		std::vector<Worker *> polled;
+		auto now = std::chrono::steady_clock::now();
+		auto wake = now + timeout;
+		for (Worker &worker : workers) {
+			while (worker.fd >= 0 && worker.pending.size() < inFlight && !queue.empty()) {
+				uint32_t index = queue.front();
+				queue.pop_front();
+				if (worker.pending.empty()) worker.deadline = now + timeout;
+				worker.pending.push_back(index);
+				if (!writeAll(worker.fd, &index, sizeof(index))) lose(worker, "lost");
+			}
+			if (worker.fd >= 0 && !worker.pending.empty()) {
+				fds.push_back(pollfd{ worker.fd, POLLIN, 0 });
+				polled.push_back(&worker);
+				wake = std::min(wake, worker.deadline);
+			}
+		}
+		if (fds.empty()) break; // no live worker is left
+
+		int waitMs = (int)std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1;
+		if (poll(fds.data(), fds.size(), std::max(waitMs, 0)) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < fds.size(); ++i) {
+			Worker &worker = *polled[i];
+			if (fds[i].revents == 0) {
+				if (now >= worker.deadline) lose(worker, "hung");
+				continue;
+			}
+			uint32_t index;
+			RayCounts counts;
+			bool ok = readAll(worker.fd, &index, sizeof(index)) && index == worker.pending.front();
+			Region tile = distributedTile(worker.pending.front(), width, height);
+			ok = ok && readAll(worker.fd, pixels.data(), tile.area() * sizeof(Vector3f)) && readAll(worker.fd, &counts, sizeof(counts));
+			if (!ok) {
+				lose(worker, "lost");
+				continue;
+			}
+			worker.pending.pop_front();
+			worker.deadline = now + timeout;
+			if (!store(index, tile, pixels.data())) {
+				failed = true;
+				break;
+			}
+			frameRays.primary += counts.primary;
+			frameRays.shadow += counts.shadow;
+			frameRays.reflection += counts.reflection;
+			frameRays.nodeTests += counts.nodeTests;
+			frameRays.primitiveTests += counts.primitiveTests;
+			++done;
+		}
+	}
+
+	// closing the sockets ends the workers' loops
+	for (Worker &worker : workers) {
+		if (worker.fd < 0) continue;
+		close(worker.fd);
+		waitpid(worker.pid, NULL, 0);
+	}
+	signal(SIGPIPE, previousHandler);
+	return !failed && done == tileCount;
+#endif
+}
+
+// prints where the cycles of the frame went, per stage of trace()
+void printProfile(const StageProfile &profile)
+{
+	double total = (double)profile.pixelCycles;
+	if (total <= 0) return;
+	std::cout << "stage\tcamera Mcycles\treflection Mcycles\tshare\tcalls" << std::endl;
+	double staged = 0;
+	for (int s = 0; s < STAGE_COUNT; ++s) {
+		double cycles = (double)(profile.cycles[0][s] + profile.cycles[1][s]);
+		staged += cycles;
+		std::cout << STAGE_NAMES[s] << "\t" << profile.cycles[0][s] * 1e-6 << "\t" << profile.cycles[1][s] * 1e-6 << "\t"
+			<< 100 * cycles / total << "%\t" << profile.calls[0][s] + profile.calls[1][s] << std::endl;
+	}
+	std::cout << "other\t\t\t" << 100 * (total - staged) / total << "%" << std::endl;
+	std::cout << "total\t" << total * 1e-6 << " Mcycles in camera samples" << std::endl;
+}
+
+// renders the whole frame into `image` and filters it if --denoise asks for it
+void renderDenoised(const Scene &scene, Vector3f *image, ThreadPool &pool)
+{
+	unsigned width = scene.camera.width;
+	unsigned height = scene.camera.height;
+	if (options.denoiseIterations > 0) {
+		primaryFeatures.assign((size_t)width * height, Features());
+		primaryFeaturesWidth = width;
+	}
+	renderImage(scene, image, pool);
+	if (!primaryFeatures.empty()) {
+		auto denoiseStart = std::chrono::steady_clock::now();
+		denoise(image, primaryFeatures, width, height, pool, scene.simd);
+		if (options.stats) {
+			std::cout << "denoise: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - denoiseStart).count() << " s" << std::endl;
+		}
+		primaryFeatures.clear();
+	}
+}
+
+void render(const Scene &scene, ThreadPool &pool)
+{
+	unsigned width = scene.camera.width;
+	unsigned height = scene.camera.height;
+
+	ImageWriter writer;
+	if (!writer.open(options.output, width, height)) {
+		std::cerr << "cannot write " << options.output << std::endl;
+		return;
+	}
+
+	frameRays = RayCounts();
+	frameProfile = StageProfile();
+	if (RT_PROFILE && !options.heatmapFile.empty()) {
+		pixelCost.assign((size_t)width * height, 0.f);
+		pixelCostWidth = width;
+	}
+	auto start = std::chrono::steady_clock::now();
+	if (options.workers > 0) {
+		// the tiles arrive in any order, so the frame is assembled in memory or in the framebuffer file
+		TiledFramebuffer framebuffer;
+		std::vector<Vector3f> image;
+		bool ok;
+		if (!options.framebufferFile.empty()) {
+			ok = framebuffer.create(options.framebufferFile, width, height) &&
+				renderDistributed(scene, options.workers, [&](unsigned index, const Region &tile, const Vector3f *pixels) {
+					TiledFramebuffer::TileView view = framebuffer.map(index);
+					if (!view.pixels) return false;
+					std::copy(pixels, pixels + tile.area(), view.pixels);
+					framebuffer.unmap(view);
+					return true;
+				}) && framebuffer.write(writer);
+		}
+		else {
+			image.resize((size_t)width * height);
+			ok = renderDistributed(scene, options.workers, [&](unsigned, const Region &tile, const Vector3f *pixels) {
+				for (unsigned y = tile.y0; y < tile.y1; ++y) {
+					std::copy(pixels + (y - tile.y0) * tile.width(), pixels + (y - tile.y0 + 1) * tile.width(), image.begin() + (size_t)y * width + tile.x0);
+				}
+				return true;
+			});
+			if (ok) writer.writeRows(0, height, image.data());
+		}
+		if (!ok) std::cerr << "distributed render failed" << std::endl;
+	}
+	else if (!options.framebufferFile.empty()) {
+		TiledFramebuffer framebuffer;
+		if (!framebuffer.create(options.framebufferFile, width, height) || !renderTiled(scene, framebuffer, pool) || !framebuffer.write(writer)) {
+			std::cerr << "cannot use framebuffer file " << options.framebufferFile << std::endl;
+		}
+	}
+	else if (options.streamRows > 0) {
+		// only one band of rows is held in memory; each is written as soon as it is finished
+		std::vector<Vector3f> band((size_t)width * std::min(options.streamRows, height));
+		for (unsigned y = 0; y < height; y += options.streamRows) {
+			Region region{ 0, y, width, std::min(y + options.streamRows, height) };
+			renderRegion(scene, region, band.data(), pool);
+			writer.writeRows(region.y0, region.height(), band.data());
+		}
+	}
+	else {
+		std::vector<Vector3f> image((size_t)width * height);
+		renderDenoised(scene, image.data(), pool);
+		writer.writeRows(0, height, image.data());
+	}
+	if (!writer.close()) std::cerr << "cannot write " << options.output << std::endl;
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (options.stats) {
+		std::cout << "rays: " << frameRays.primary << " primary, " << frameRays.shadow << " shadow, "
+			<< frameRays.reflection << " reflection, " << frameRays.total() << " total" << std::endl;
+		std::cout << "time: " << seconds << " s, " << frameRays.total() / seconds << " rays/s" << std::endl;
+		if (RT_COUNTERS) {
+			std::cout << "tests per ray: " << frameRays.nodeTests / double(frameRays.total()) << " nodes, "
+				<< frameRays.primitiveTests / double(frameRays.total()) << " primitives" << std::endl;
+		}
+		if (options.aaMaxSamples > 1) {
+			// a uniformly supersampled frame costs about the centre-sample frame times the sample count
+			long long pixels = (long long)width * height;
+			std::cout << "adaptive supersampling: " << frameRays.primary / double(pixels) << " camera samples per pixel, uniform "
+				<< options.aaMaxSamples << "x would trace about " << (long long)(frameRays.total() / double(frameRays.primary) * pixels * options.aaMaxSamples)
+				<< " rays" << std::endl;
+		}
+		printProfile(frameProfile);
+	}
+
+	if (!pixelCost.empty()) {
+		if (!writeHeatmap(options.heatmapFile, width, height)) std::cerr << "cannot write " << options.heatmapFile << std::endl;
+		pixelCost.clear();
+	}
+}
+
+// Progressive rendering: every pass adds one camera sample to each pixel, in the order of samplePosition(),
+// and writes the running average as a preview, so the first pass is the ordinary centre-sample image.
+// The running sums are saved to a checkpoint file every few passes and when the process is asked to stop.
+// A sample's random numbers are seeded from its pixel and sample index, so the pass count is the whole
+// RNG state and a resumed render adds exactly the samples it would have added without the interruption.
+//
+// The checkpoint is a CheckpointHeader followed by the RGB float sums of the pixels row by row, in the
+// byte order of the machine that writes it.
+
+const char CHECKPOINT_MAGIC[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '0', '1' };
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t passes;      // samples in every pixel's sum
+	uint32_t reserved;
+	uint64_t fingerprint; // sceneFingerprint() of the scene being rendered
+};
+
+// hash of everything that changes the samples: the scene and the sampling options
+uint64_t sceneFingerprint(const Scene &scene)
+{
+	uint64_t hash = 14695981039346656037ull; // FNV-1a
+	auto add = [&](const void *data, size_t size) {
+		const unsigned char *p = (const unsigned char *)data;
+		for (size_t i = 0; i < size; ++i) hash = (hash ^ p[i]) * 1099511628211ull;
+	};
+	auto addVector = [&](const Vector3f &v) { add(v.data(), 3 * sizeof(float)); };
+
+	add(&scene.camera.width, sizeof(unsigned));
+	add(&scene.camera.height, sizeof(unsigned));
+	add(&scene.camera.fov, sizeof(float));
+	addVector(scene.camera.position);
+	add(scene.camera.orientation.data(), 9 * sizeof(float));
+	addVector(scene.background);
+	for (const std::vector<Vector3f> &cluster : scene.lights) {
+		size_t points = cluster.size();
+		add(&points, sizeof(points));
+		for (const Vector3f &light : cluster) addVector(light);
+	}
+	float phongConstants[3] = { scene.kd, scene.ks, scene.alpha };
+	add(phongConstants, sizeof(phongConstants));
+	for (const Sphere &sphere : scene.spheres) {
+		addVector(sphere.center);
+		add(&sphere.radius, sizeof(float));
+		addVector(sphere.surfaceColor);
+		add(&sphere.specular, sizeof(bool));
+	}
+	for (const TriangleMesh &mesh : scene.meshes) {
+		for (const Vector3f &v : mesh.vertices) addVector(v);
+		for (const Vector3f &n : mesh.normals) addVector(n);
+		add(mesh.triangles.data(), mesh.triangles.size() * sizeof(Vector3i));
+		addVector(mesh.surfaceColor);
+		add(&mesh.specular, sizeof(bool));
+	}
+	for (const SphereGroup &group : scene.groups) {
+		size_t count = group.spheres.size();
+		add(&count, sizeof(count));
+		for (const Sphere &sphere : group.spheres) {
+			addVector(sphere.center);
+			add(&sphere.radius, sizeof(float));
+			addVector(sphere.surfaceColor);
+			add(&sphere.specular, sizeof(bool));
+		}
+	}
+	for (const Instance &instance : scene.instances) {
+		int object[2] = { instance.mesh, instance.group };
+		add(object, sizeof(object));
+		add(instance.linear.data(), 9 * sizeof(float));
+		addVector(instance.translation);
+	}
+	// the gamma curve and the output decide where contribution termination cuts paths
+	int sampling[5] = { (int)options.termination, (int)options.lightSamples, (int)options.lightProbes, scene.floatOutput, scene.averagedOutput };
+	add(sampling, sizeof(sampling));
+	add(&options.gamma, sizeof(float));
+	add(&options.lightTreeSamples, sizeof(unsigned));
+	add(&options.lightCull, sizeof(float));
+	return hash;
+}
+
+// writes the checkpoint next to its final name and renames it into place, so a process killed while
+// writing leaves the previous checkpoint intact
+bool writeCheckpoint(const std::string &path, const CheckpointHeader &header, const std::vector<Vector3f> &sums)
+{
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary.c_str(), std::ios::out | std::ios::binary);
+		out.write((const char *)&header, sizeof(header));
+		out.write((const char *)sums.data(), sums.size() * sizeof(Vector3f));
+		out.close();
+		if (out.fail()) return false;
+	}
+#ifdef _WIN32
+	std::remove(path.c_str());
+#endif
+	return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// reads a checkpoint of a matching scene into `sums` and returns its pass count, or 0
+unsigned readCheckpoint(const std::string &path, const Scene &scene, uint64_t fingerprint, std::vector<Vector3f> &sums)
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	CheckpointHeader header;
+	if (!in.read((char *)&header, sizeof(header))) return 0;
+	if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || header.width != scene.camera.width ||
+		header.height != scene.camera.height || header.fingerprint != fingerprint) {
+		std::cerr << path << " is a checkpoint of a different scene or settings" << std::endl;
+		return 0;
+	}
+	if (!in.read((char *)sums.data(), sums.size() * sizeof(Vector3f))) {
+		std::cerr << "cannot read " << path << std::endl;
+		return 0;
+	}
+	return header.passes;
+}
+
+// set by SIGINT and SIGTERM during a progressive render (finish the pass, checkpoint and stop) and while
+// the render server listens on a socket
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int)
+{
+	stopRequested = 1;
+}
+
+void renderProgressive(const Scene &scene, ThreadPool &pool)
+{
+	const Camera &camera = scene.camera;
+	unsigned width = camera.width;
+	unsigned height = camera.height;
+	std::vector<Vector3f> sums((size_t)width * height, Vector3f::Zero());
+	std::vector<Vector3f> preview(sums.size());
+
+	CheckpointHeader header;
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.width = width;
+	header.height = height;
+	header.passes = 0;
+	header.reserved = 0;
+	header.fingerprint = sceneFingerprint(scene);
+	if (options.resume && !options.checkpointFile.empty()) {
+		header.passes = readCheckpoint(options.checkpointFile, scene, header.fingerprint, sums);
+		if (header.passes == 0) std::fill(sums.begin(), sums.end(), Vector3f::Zero());
+		else std::cout << "resuming after pass " << header.passes << std::endl;
+	}
+
+	// the mean of the passes so far
+	auto writeImage = [&]() {
+		for (size_t i = 0; i < sums.size(); ++i) preview[i] = sums[i] / float(header.passes);
+		ImageWriter writer;
+		if (!writer.open(options.output, width, height)) std::cerr << "cannot write " << options.output << std::endl;
+		writer.writeRows(0, height, preview.data());
+		if (!writer.close()) std::cerr << "cannot write " << options.output << std::endl;
+	};
+
+	stopRequested = 0;
+	void (*previousInt)(int) = signal(SIGINT, requestStop);
+	void (*previousTerm)(int) = signal(SIGTERM, requestStop);
+
+	// a checkpoint that already has the passes asked for is still written out, e.g. to another output file
+	if (header.passes >= options.passes) {
+		std::cout << "the checkpoint already has " << header.passes << " passes" << std::endl;
+		writeImage();
+	}
+
+	frameRays = RayCounts();
+	while (header.passes < options.passes && !stopRequested) {
+		int sample = (int)header.passes;
+		float sx, sy;
+		samplePosition(sample, sx, sy);
+		parallelTiles(Region{ 0, 0, width, height }, pool, [&](unsigned x0, unsigned y0, unsigned x1, unsigned y1) {
+			for (unsigned y = y0; y < y1; ++y) {
+				for (unsigned x = x0; x < x1; ++x) {
+					seedPath(x, y, sample);
+					sums[(size_t)y * width + x] += trace(camera.position, camera.rayDirection(x + sx, y + sy), scene, 0);
+				}
+			}
+		});
+		header.passes++;
+		writeImage();
+
+		bool last = header.passes == options.passes || stopRequested;
+		if (!options.checkpointFile.empty() && (last || header.passes % std::max(1u, options.checkpointEvery) == 0)) {
+			if (!writeCheckpoint(options.checkpointFile, header, sums)) std::cerr << "cannot write " << options.checkpointFile << std::endl;
+		}
+		std::cout << "pass " << header.passes << "/" << options.passes << std::endl;
+	}
+	if (stopRequested) std::cout << "stopped after pass " << header.passes << std::endl;
+
+	signal(SIGINT, previousInt);
+	signal(SIGTERM, previousTerm);
+	if (options.stats) {
+		std::cout << "rays: " << frameRays.primary << " primary, " << frameRays.shadow << " shadow, "
+			<< frameRays.reflection << " reflection, " << frameRays.total() << " total" << std::endl;
+	}
+}
+
+// renders the frame with 1..N threads and prints the wall-clock time and speedup of each run
+void measureScaling(const Scene &scene, unsigned maxThreads)
+{
+	std::vector<Vector3f> image(scene.camera.width * scene.camera.height);
+
+	std::cout << "threads\tseconds\tspeedup" << std::endl;
+	double serial = 0;
+	for (unsigned n = 1; n <= maxThreads; ++n) {
+		ThreadPool pool(n);
+		auto start = std::chrono::steady_clock::now();
+		renderImage(scene, image.data(), pool);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (n == 1) serial = seconds;
+		std::cout << n << "\t" << seconds << "\t" << serial / seconds << std::endl;
+	}
+}
+
+// --check-denoise: renders the frame with every light sample as the reference, then with --light-samples
+// (1 if unset) before and after --denoise (3 iterations if unset), and passes if denoising takes at least
+// a fifth off the RMSE of the 8-bit output
+bool checkDenoiser(const Scene &scene, ThreadPool &pool)
+{
+	size_t n = (size_t)scene.camera.width * scene.camera.height;
+	std::vector<Vector3f> reference(n), noisy(n), denoised(n);
+	RenderOptions saved = options;
+	options.lightSamples = 0;
+	options.denoiseIterations = 0;
+	renderImage(scene, reference.data(), pool);
+	options.lightSamples = saved.lightSamples > 0 ? saved.lightSamples : 1;
+	renderImage(scene, noisy.data(), pool);
+	options.denoiseIterations = saved.denoiseIterations > 0 ? saved.denoiseIterations : 3;
+	renderDenoised(scene, denoised.data(), pool);
+	unsigned samples = options.lightSamples, iterations = options.denoiseIterations;
+	options = saved;
+
+	auto rmse = [&](const std::vector<Vector3f> &image) {
+		std::vector<unsigned char> a(3 * n), b(3 * n);
+		quantize(reference[0].data(), a.data(), 3 * n, options.gamma);
+		quantize(image[0].data(), b.data(), 3 * n, options.gamma);
+		double sum = 0;
+		for (size_t i = 0; i < 3 * n; ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+		return std::sqrt(sum / (3 * n));
+	};
+	double before = rmse(noisy), after = rmse(denoised);
+	bool passed = after <= 0.8 * before;
+	std::cout << "denoise check: RMSE " << before << " with " << samples << " light samples, " << after << " after "
+		<< iterations << " iterations: " << (passed ? "passed" : "FAILED") << std::endl;
+	return passed;
+}
+
+// Scene files.
+//
+// The text format has one statement per line; '#' starts a comment:
+//
+//   camera WIDTH HEIGHT FOV [X Y Z TX TY TZ]
+//                                     image size and field of view; the camera is at X Y Z looking at TX TY TZ,
+//                                     or at the origin looking down -z
+//   background R G B
+//   material NAME R G B SPECULAR      SPECULAR is 0 or 1
+//   sphere X Y Z RADIUS MATERIAL
+//   mesh FILE MATERIAL [SCALE [X Y Z]] OBJ file, relative to the scene file; vertices are scaled, then moved
+//   object NAME mesh ...              a mesh that is only placed by instances
+//   object NAME sphere ...            a sphere of the sphere group NAME, which is only placed by instances
+//   instance NAME X Y Z [A00 A01 A02 A10 A11 A12 A20 A21 A22]
+//                                     places an object: translation, then the linear part row by row
+//   light X Y Z [X Y Z ...]           one light cluster per line
+//   phong KD KS ALPHA                 Phong constants of every surface, 1 3 100 if not given
+//
+// The binary format holds spheres only and is a header followed by 64-byte aligned sections. The BVH nodes, leaf order and SoA
+// sphere arrays are stored exactly as the renderer uses them, so a binary scene is mapped and rendered
+// without parsing or rebuilding anything. It is written in the byte order and struct layout of the
+// machine that writes it. The last byte of the magic is the format version.
+
+const char SCENE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '2' };
+
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32_t sphereCount;
+	uint32_t materialCount;
+	uint32_t clusterCount;
+	uint32_t lightCount;    // points over all clusters
+	uint32_t nodeCount;
+	uint32_t soaSize;       // length of each SoA array, padding included
+	uint32_t width;
+	uint32_t height;
+	float fov;
+	float background[3];
+	float phong[3];         // kd, ks and alpha
+	uint32_t reserved;
+	uint64_t materialsOffset;      // SceneFileMaterial[materialCount]
+	uint64_t sphereMaterialOffset; // uint32_t[sphereCount], by sphere index
+	uint64_t clusterSizeOffset;    // uint32_t[clusterCount]
+	uint64_t lightsOffset;         // float[3 * lightCount]
+	uint64_t nodesOffset;          // BVH::Node[nodeCount]
+	uint64_t indicesOffset;        // int32_t[sphereCount], sphere index of each leaf slot
+	uint64_t soaOffset;            // float[5 * soaSize]: centre x, y, z, radius, radius^2
+};
+
+struct SceneFileMaterial
+{
+	float color[3];
+	uint32_t specular;
+};
+
+static_assert(sizeof(BVH::Node) == 9 * 4, "BVH nodes are written to binary scene files as they are");
+
+// distinct (colour, specular) pairs of a scene, and the material of every sphere, mesh and group sphere
+struct SceneMaterials
+{
+	std::vector<SceneFileMaterial> materials;
+	std::vector<uint32_t> sphere;
+	std::vector<uint32_t> mesh;
+	std::vector<std::vector<uint32_t>> group;
+};
+
+void collectMaterials(const Scene &scene, SceneMaterials &result)
+{
+	std::map<std::vector<float>, uint32_t> known;
+	auto materialOf = [&](const Vector3f &color, bool specular) {
+		std::vector<float> key = { color(0), color(1), color(2), specular ? 1.f : 0.f };
+		auto found = known.find(key);
+		if (found == known.end()) {
+			found = known.insert(std::make_pair(key, (uint32_t)result.materials.size())).first;
+			result.materials.push_back(SceneFileMaterial{ { key[0], key[1], key[2] }, (uint32_t)specular });
+		}
+		return found->second;
+	};
+	for (const Sphere &sphere : scene.spheres) result.sphere.push_back(materialOf(sphere.surfaceColor, sphere.specular));
+	for (const TriangleMesh &mesh : scene.meshes) result.mesh.push_back(materialOf(mesh.surfaceColor, mesh.specular));
+	for (const SphereGroup &group : scene.groups) {
+		result.group.emplace_back();
+		for (const Sphere &sphere : group.spheres) result.group.back().push_back(materialOf(sphere.surfaceColor, sphere.specular));
+	}
+}
+
+// reads WIDTH HEIGHT FOV [X Y Z TX TY TZ] of a camera statement; without a target the viewpoint is kept
+bool readCamera(std::istream &in, Camera &camera)
+{
+	// read signed, as an unsigned read would take "-1" for a huge width
+	long long width, height;
+	if (!(in >> width >> height >> camera.fov) || width <= 0 || height <= 0 || width > UINT32_MAX || height > UINT32_MAX) return false;
+	camera.width = (unsigned)width;
+	camera.height = (unsigned)height;
+	Vector3f eye, target;
+	if (in >> eye(0)) {
+		if (!(in >> eye(1) >> eye(2) >> target(0) >> target(1) >> target(2)) || eye == target) return false;
+		camera.lookAt(eye, target);
+	}
+	return true;
+}
+
+// parses a text scene; `name` is used in error messages and mesh files are relative to `directory`
+bool loadSceneText(std::istream &in, const std::string &name, const std::string &directory, Scene &scene)
+{
+	std::map<std::string, std::pair<Vector3f, bool>> materials;
+	std::map<std::string, std::pair<int, int>> objects; // name: mesh or group index
+	scene.spheres.clear();
+	scene.meshes.clear();
+	scene.groups.clear();
+	scene.instances.clear();
+	scene.lights.clear();
+	scene.kd = KD;
+	scene.ks = KS;
+	scene.alpha = ALPHA;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(in, line)) {
+		++lineNumber;
+		line = line.substr(0, line.find('#'));
+		std::istringstream ls(line);
+		std::string keyword, objectName;
+		if (!(ls >> keyword)) continue;
+
+		// "object NAME" in front of a mesh or sphere statement makes it part of a shared object
+		if (keyword == "object" && !(ls >> objectName >> keyword && (keyword == "mesh" || keyword == "sphere"))) keyword = "";
+
+		bool ok = true;
+		if (keyword == "camera") {
+			ok = readCamera(ls, scene.camera);
+		}
+		else if (keyword == "background") {
+			ok = (bool)(ls >> scene.background(0) >> scene.background(1) >> scene.background(2));
+		}
+		else if (keyword == "material") {
+			std::string name;
+			Vector3f color;
+			int specular;
+			ok = (bool)(ls >> name >> color(0) >> color(1) >> color(2) >> specular);
+			materials[name] = std::make_pair(color, specular != 0);
+		}
+		else if (keyword == "sphere") {
+			Vector3f center;
+			float radius;
+			std::string name;
+			ok = (bool)(ls >> center(0) >> center(1) >> center(2) >> radius >> name) && materials.count(name);
+			Sphere sphere(center, radius, materials[name].first, materials[name].second);
+			if (ok && objectName.empty()) {
+				scene.spheres.push_back(sphere);
+			}
+			else if (ok) {
+				// the spheres of an object form a sphere group
+				if (!objects.count(objectName)) {
+					scene.groups.emplace_back();
+					objects[objectName] = std::make_pair(-1, (int)scene.groups.size() - 1);
+				}
+				ok = objects[objectName].second >= 0;
+				if (ok) scene.groups[objects[objectName].second].spheres.push_back(sphere);
+			}
+		}
+		else if (keyword == "mesh") {
+			std::string file, name;
+			float scale = 1.f;
+			Vector3f offset = Vector3f::Zero();
+			ok = (bool)(ls >> file >> name) && materials.count(name) && !objects.count(objectName);
+			if (ok && ls >> scale) ok = (bool)(ls >> offset(0) >> offset(1) >> offset(2)) || ls.eof();
+			if (ok && file[0] != '/' && file[0] != '\\' && file.find(':') == std::string::npos) file = directory + file;
+			TriangleMesh mesh;
+			ok = ok && loadObj(file, mesh);
+			if (ok) {
+				mesh.transform(scale, offset);
+				mesh.surfaceColor = materials[name].first;
+				mesh.specular = materials[name].second;
+				scene.meshes.push_back(std::move(mesh));
+				int m = (int)scene.meshes.size() - 1;
+				// a mesh statement places the mesh once, an object is only placed by instances
+				if (objectName.empty()) scene.addInstance(m, -1, Matrix3f::Identity(), Vector3f::Zero());
+				else objects[objectName] = std::make_pair(m, -1);
+			}
+		}
+		else if (keyword == "instance") {
+			std::string name;
+			Vector3f translation;
+			Matrix3f linear = Matrix3f::Identity();
+			ok = (bool)(ls >> name >> translation(0) >> translation(1) >> translation(2)) && objects.count(name);
+			if (ok && ls >> linear(0, 0)) {
+				for (int k = 1; ok && k < 9; ++k) ok = (bool)(ls >> linear(k / 3, k % 3));
+			}
+			if (ok) scene.addInstance(objects[name].first, objects[name].second, linear, translation);
+		}
+		else if (keyword == "light") {
+			std::vector<Vector3f> cluster;
+			Vector3f p;
+			while (ls >> p(0) >> p(1) >> p(2)) cluster.push_back(p);
+			ok = !cluster.empty();
+			scene.lights.push_back(cluster);
+		}
+		else if (keyword == "phong") {
+			ok = (bool)(ls >> scene.kd >> scene.ks >> scene.alpha);
+		}
+		else {
+			ok = false;
+		}
+		if (!ok) {
+			std::cerr << name << ":" << lineNumber << ": cannot parse '" << line << "'" << std::endl;
+			return false;
+		}
+	}
+
+	std::cout << "Loaded " << scene.spheres.size() << " spheres, " << scene.instances.size() << " instances and " << scene.lights.size() << " light clusters" << std::endl;
+	return true;
+}
+
+bool loadSceneText(const std::string &path, Scene &scene)
+{
+	std::ifstream in(path.c_str());
+	if (!in.is_open()) return false;
+
+	size_t slash = path.find_last_of("/\\");
+	return loadSceneText(in, path, slash == std::string::npos ? "" : path.substr(0, slash + 1), scene);
+}
+
+bool saveSceneText(const std::string &path, const Scene &scene)
+{
+	std::ofstream out(path.c_str());
+	if (!out.is_open()) return false;
+
+	SceneMaterials materials;
+	collectMaterials(scene, materials);
+	const std::vector<SceneFileMaterial> &table = materials.materials;
+
+	out.precision(9);
+	const Camera &camera = scene.camera;
+	out << "camera " << camera.width << " " << camera.height << " " << camera.fov;
+	if (camera.orientation != Matrix3f::Identity() || camera.position != Vector3f::Zero()) {
+		out << " " << camera.position(0) << " " << camera.position(1) << " " << camera.position(2)
+			<< " " << camera.target(0) << " " << camera.target(1) << " " << camera.target(2);
+	}
+	out << "\n";
+	out << "background " << scene.background(0) << " " << scene.background(1) << " " << scene.background(2) << "\n";
+	for (size_t m = 0; m < table.size(); ++m) {
+		out << "material m" << m << " " << table[m].color[0] << " " << table[m].color[1] << " " << table[m].color[2]
+			<< " " << table[m].specular << "\n";
+	}
+	auto writeSphere = [&](const Sphere &sphere, uint32_t material) {
+		out << "sphere " << sphere.center(0) << " " << sphere.center(1) << " " << sphere.center(2) << " " << sphere.radius
+			<< " m" << material << "\n";
+	};
+	for (size_t i = 0; i < scene.spheres.size(); ++i) writeSphere(scene.spheres[i], materials.sphere[i]);
+	for (size_t i = 0; i < scene.meshes.size(); ++i) {
+		const TriangleMesh &mesh = scene.meshes[i];
+		out << "object mesh" << i << " mesh " << mesh.file << " m" << materials.mesh[i] << " " << mesh.scale << " "
+			<< mesh.offset(0) << " " << mesh.offset(1) << " " << mesh.offset(2) << "\n";
+	}
+	for (size_t i = 0; i < scene.groups.size(); ++i) {
+		for (size_t k = 0; k < scene.groups[i].spheres.size(); ++k) {
+			out << "object group" << i << " ";
+			writeSphere(scene.groups[i].spheres[k], materials.group[i][k]);
+		}
+	}
+	for (const Instance &instance : scene.instances) {
+		if (instance.mesh >= 0) out << "instance mesh" << instance.mesh;
+		else out << "instance group" << instance.group;
+		for (int c = 0; c < 3; ++c) out << " " << instance.translation(c);
+		for (int k = 0; k < 9; ++k) out << " " << instance.linear(k / 3, k % 3);
+		out << "\n";
+	}
+	for (const std::vector<Vector3f> &cluster : scene.lights) {
+		out << "light";
+		for (const Vector3f &p : cluster) out << " " << p(0) << " " << p(1) << " " << p(2);
+		out << "\n";
+	}
+	out << "phong " << scene.kd << " " << scene.ks << " " << scene.alpha << "\n";
+	return (bool)out;
+}
+
+// writes the scene with its BVH, which must have been built
+bool saveSceneBinary(const std::string &path, const Scene &scene)
+{
+	if (!scene.instances.empty()) {
+		std::cerr << "binary scenes cannot hold instances" << std::endl;
+		return false;
+	}
+	if (scene.camera.position != Vector3f::Zero() || scene.camera.orientation != Matrix3f::Identity()) {
+		std::cerr << "binary scenes keep the camera at the origin, its viewpoint is not saved" << std::endl;
+	}
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::binary);
+	if (!out.is_open()) return false;
+
+	SceneMaterials sceneMaterials;
+	collectMaterials(scene, sceneMaterials);
+	const std::vector<SceneFileMaterial> &materials = sceneMaterials.materials;
+	const std::vector<uint32_t> &sphereMaterial = sceneMaterials.sphere;
+
+	std::vector<uint32_t> clusterSize;
+	std::vector<float> lights;
+	for (const std::vector<Vector3f> &cluster : scene.lights) {
+		clusterSize.push_back((uint32_t)cluster.size());
+		for (const Vector3f &p : cluster) lights.insert(lights.end(), { p(0), p(1), p(2) });
+	}
+
+	SceneFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+	header.sphereCount = (uint32_t)scene.spheres.size();
+	header.materialCount = (uint32_t)materials.size();
+	header.clusterCount = (uint32_t)clusterSize.size();
+	header.lightCount = (uint32_t)(lights.size() / 3);
+	header.nodeCount = (uint32_t)scene.bvh.nodes.size;
+	header.soaSize = (uint32_t)scene.soa.centerX.size;
+	header.width = scene.camera.width;
+	header.height = scene.camera.height;
+	header.fov = scene.camera.fov;
+	for (int c = 0; c < 3; ++c) header.background[c] = scene.background(c);
+	header.phong[0] = scene.kd;
+	header.phong[1] = scene.ks;
+	header.phong[2] = scene.alpha;
+
+	// lay the sections out one after another, each starting on a 64-byte boundary
+	struct Section { uint64_t *offset; const void *data; size_t bytes; };
+	std::vector<Section> sections = {
+		{ &header.materialsOffset, materials.data(), materials.size() * sizeof(SceneFileMaterial) },
+		{ &header.sphereMaterialOffset, sphereMaterial.data(), sphereMaterial.size() * sizeof(uint32_t) },
+		{ &header.clusterSizeOffset, clusterSize.data(), clusterSize.size() * sizeof(uint32_t) },
+		{ &header.lightsOffset, lights.data(), lights.size() * sizeof(float) },
+		{ &header.nodesOffset, scene.bvh.nodes.data, scene.bvh.nodes.size * sizeof(BVH::Node) },
+		{ &header.indicesOffset, scene.bvh.indices.data, scene.bvh.indices.size * sizeof(int) },
+		{ &header.soaOffset, scene.soa.centerX.data, 5 * scene.soa.centerX.size * sizeof(float) },
+	};
+	uint64_t offset = sizeof(SceneFileHeader);
+	for (Section &section : sections) {
+		offset = (offset + 63) / 64 * 64;
+		*section.offset = offset;
+		offset += section.bytes;
+	}
+
+	out.write((const char *)&header, sizeof(header));
+	uint64_t written = sizeof(header);
+	for (Section &section : sections) {
+		static const char zeros[64] = {};
+		out.write(zeros, *section.offset - written);
+		out.write((const char *)section.data, section.bytes);
+		written = *section.offset + section.bytes;
+	}
+	return (bool)out;
+}
+
+// checks a mapped BVH before it is traversed: interior nodes must split on an axis and have both children
+// after them in the node array, leaves must lie inside the leaf slots, and no path may be deeper than the
+// traversal stack. Returns the first problem found, or an empty string.
+std::string checkSceneNodes(const BVH::Node *nodes, uint32_t nodeCount, uint32_t sphereCount)
+{
+	if (nodeCount == 0) return sphereCount == 0 ? "" : "no BVH nodes for " + std::to_string(sphereCount) + " spheres";
+	// children follow their parent, so a forward sweep sees every parent before its children
+	std::vector<int> depth(nodeCount, 0);
+	for (uint32_t i = 0; i < nodeCount; ++i) {
+		const BVH::Node &node = nodes[i];
+		std::string where = "BVH node " + std::to_string(i) + ": ";
+		if (node.count < 0) return where + "negative sphere count " + std::to_string(node.count);
+		if (node.count > 0) {
+			if (node.offset < 0 || (uint32_t)node.count > sphereCount || (uint32_t)node.offset > sphereCount - node.count) {
+				return where + "leaf slots " + std::to_string(node.offset) + ".." + std::to_string((int64_t)node.offset + node.count) +
+					" outside the " + std::to_string(sphereCount) + " slots";
+			}
+			continue;
+		}
+		if (node.axis < 0 || node.axis > 2) return where + "split axis " + std::to_string(node.axis);
+		if (i + 1 >= nodeCount || node.offset <= (int64_t)i + 1 || (uint32_t)node.offset >= nodeCount) {
+			return where + "children " + std::to_string(i + 1) + " and " + std::to_string(node.offset) + " not after it among the " +
+				std::to_string(nodeCount) + " nodes";
+		}
+		if (depth[i] + 1 >= BVH::MAX_STACK) return where + "deeper than the traversal stack of " + std::to_string(BVH::MAX_STACK);
+		depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+		depth[node.offset] = std::max(depth[node.offset], depth[i] + 1);
+	}
+	return "";
+}
+
+// maps a binary scene; the BVH and SoA arrays are used in place, only the per-sphere shading data is unpacked
+bool loadSceneBinary(const std::string &path, Scene &scene)
+{
+	std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+	if (!file->open(path)) {
+		std::cerr << "cannot map " << path << std::endl;
+		return false;
+	}
+	auto invalid = [&](const std::string &problem) {
+		std::cerr << path << ": not a valid binary scene: " << problem << std::endl;
+		return false;
+	};
+	if (file->size() < sizeof(SceneFileHeader)) return invalid("shorter than the header");
+
+	const char *base = file->data();
+	SceneFileHeader header;
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC) - 1) != 0) return invalid("wrong magic");
+	if (header.magic[7] != SCENE_MAGIC[7]) return invalid(std::string("format version ") + header.magic[7] + ", save the scene again");
+	if (header.soaSize != SphereSoA::paddedSize(header.sphereCount)) return invalid("SoA size does not match the sphere count");
+	if (header.width == 0 || header.height == 0) return invalid("empty image");
+
+	struct Section { const char *name; uint64_t offset; uint64_t bytes; };
+	const Section sections[] = {
+		{ "materials", header.materialsOffset, (uint64_t)header.materialCount * sizeof(SceneFileMaterial) },
+		{ "sphere materials", header.sphereMaterialOffset, (uint64_t)header.sphereCount * sizeof(uint32_t) },
+		{ "cluster sizes", header.clusterSizeOffset, (uint64_t)header.clusterCount * sizeof(uint32_t) },
+		{ "lights", header.lightsOffset, (uint64_t)header.lightCount * 3 * sizeof(float) },
+		{ "BVH nodes", header.nodesOffset, (uint64_t)header.nodeCount * sizeof(BVH::Node) },
+		{ "leaf indices", header.indicesOffset, (uint64_t)header.sphereCount * sizeof(int) },
+		{ "SoA", header.soaOffset, (uint64_t)header.soaSize * 5 * sizeof(float) },
+	};
+	for (const Section &section : sections) {
+		if (section.offset % 4 != 0 || section.offset > file->size() || section.bytes > file->size() - section.offset) {
+			return invalid(std::string(section.name) + " section outside the file");
+		}
+	}
+	std::string problem = checkSceneNodes((const BVH::Node *)(base + header.nodesOffset), header.nodeCount, header.sphereCount);
+	if (!problem.empty()) return invalid(problem);
+
+	const SceneFileMaterial *materials = (const SceneFileMaterial *)(base + header.materialsOffset);
+	const uint32_t *sphereMaterial = (const uint32_t *)(base + header.sphereMaterialOffset);
+	const uint32_t *clusterSize = (const uint32_t *)(base + header.clusterSizeOffset);
+	const float *lights = (const float *)(base + header.lightsOffset);
+	const int *indices = (const int *)(base + header.indicesOffset);
+	const float *soa = (const float *)(base + header.soaOffset);
+
+	// every cluster has lights, as in the text format, and together they use every light
+	uint64_t clusteredLights = 0;
+	for (uint32_t j = 0; j < header.clusterCount; ++j) {
+		if (clusterSize[j] == 0) return invalid("light cluster " + std::to_string(j) + " is empty");
+		clusteredLights += clusterSize[j];
+	}
+	if (clusteredLights != header.lightCount) {
+		return invalid("light clusters hold " + std::to_string(clusteredLights) + " of " + std::to_string(header.lightCount) + " lights");
+	}
+
+	scene.camera.width = header.width;
+	scene.camera.height = header.height;
+	scene.camera.fov = header.fov;
+	scene.background = Vector3f(header.background[0], header.background[1], header.background[2]);
+	scene.kd = header.phong[0];
+	scene.ks = header.phong[1];
+	scene.alpha = header.phong[2];
+
+	scene.meshes.clear();
+	scene.groups.clear();
+	scene.instances.clear();
+	scene.lights.clear();
+	uint32_t light = 0;
+	for (uint32_t j = 0; j < header.clusterCount; ++j) {
+		std::vector<Vector3f> cluster;
+		for (uint32_t m = 0; m < clusterSize[j]; ++m, ++light) {
+			cluster.push_back(Vector3f(lights[3 * light], lights[3 * light + 1], lights[3 * light + 2]));
+		}
+		scene.lights.push_back(cluster);
+	}
+
+	// the SoA arrays are in leaf order; the shading data is kept by sphere index
+	size_t n = header.sphereCount;
+	std::vector<int> slot(n, -1);
+	for (size_t i = 0; i < n; ++i) {
+		if (indices[i] < 0 || (size_t)indices[i] >= n) return invalid("leaf slot " + std::to_string(i) + " holds sphere " + std::to_string(indices[i]));
+		if (slot[indices[i]] >= 0) return invalid("sphere " + std::to_string(indices[i]) + " in two leaf slots");
+		slot[indices[i]] = (int)i;
+	}
+	scene.spheres.clear();
+	scene.spheres.reserve(n);
+	for (size_t k = 0; k < n; ++k) {
+		int i = slot[k];
+		if (i < 0) return invalid("sphere " + std::to_string(k) + " in no leaf slot");
+		if (sphereMaterial[k] >= header.materialCount) return invalid("sphere " + std::to_string(k) + " has material " + std::to_string(sphereMaterial[k]));
+		const SceneFileMaterial &material = materials[sphereMaterial[k]];
+		scene.spheres.push_back(Sphere(Vector3f(soa[i], soa[header.soaSize + i], soa[2 * header.soaSize + i]), soa[3 * header.soaSize + i],
+			Vector3f(material.color[0], material.color[1], material.color[2]), material.specular != 0));
+	}
+
+	scene.bvh.attach((const BVH::Node *)(base + header.nodesOffset), header.nodeCount, indices, n);
+	scene.soa.attach(soa, header.soaSize);
+	scene.mapping = file;
+
+	std::cout << "Mapped " << n << " spheres and " << scene.lights.size() << " light clusters" << std::endl;
+	return true;
+}
+
+// loads a binary or text scene, told apart by the binary magic; binary scenes come with their BVH
+bool loadScene(const std::string &path, Scene &scene)
+{
+	char magic[sizeof(SCENE_MAGIC)] = {};
+	std::ifstream probe(path.c_str(), std::ios::in | std::ios::binary);
+	if (!probe.is_open()) {
+		std::cerr << "cannot open " << path << std::endl;
+		return false;
+	}
+	probe.read(magic, sizeof(magic));
+	probe.close();
+
+	// every format version is a binary scene, which loadSceneBinary() accepts or reports
+	if (std::memcmp(magic, SCENE_MAGIC, sizeof(SCENE_MAGIC) - 1) == 0) return loadSceneBinary(path, scene);
+	return loadSceneText(path, scene);
+}
+
+// Frame sequences.
+//
+// An animation file lists the changes made to the scene before every frame after the first:
+//
+//   frame                             starts the changes of the next frame
+//   sphere INDEX X Y Z                moves a sphere of the scene
+//   instance INDEX X Y Z [A00 A01 A02 A10 A11 A12 A20 A21 A22]
+//                                     places an instance anew, as in a scene file
+//   vertices MESH FILE                new vertex positions of a mesh, e.g. a skinned pose, from an OBJ file
+//                                     with the same vertices; the mesh's scale and offset are applied
+//   light INDEX X Y Z [X Y Z ...]     new points of a light cluster; the index after the last adds a cluster
+//   color sphere|mesh INDEX R G B     new surface colour of a sphere or a mesh
+//   phong KD KS ALPHA                 new Phong constants
+//
+// Without a file, --frames N makes the smaller spheres of the scene bob up and down.
+
+// what the changes of a frame touch
+enum FrameChange
+{
+	CHANGE_LIGHTING = 1, // lights, surface colours or Phong constants
+	CHANGE_GEOMETRY = 2  // spheres, instances or mesh vertices
+};
+
+class Animation
+{
+public:
+	bool load(const std::string &path)
+	{
+		std::ifstream in(path.c_str());
+		if (!in.is_open()) {
+			std::cerr << "cannot open " << path << std::endl;
+			return false;
+		}
+		size_t slash = path.find_last_of("/\\");
+		return read(in, path, slash == std::string::npos ? "" : path.substr(0, slash + 1));
+	}
+
+	// parses the statements of an animation; `name` is used in error messages and mesh files are relative
+	// to `directory`
+	bool read(std::istream &in, const std::string &name, const std::string &directory)
+	{
+		this->directory = directory;
+		file = name;
+		std::string line;
+		while (std::getline(in, line)) {
+			line = line.substr(0, line.find('#'));
+			std::istringstream ls(line);
+			std::string keyword;
+			if (!(ls >> keyword)) continue;
+			if (keyword == "frame") frames.emplace_back();
+			else if (frames.empty()) {
+				std::cerr << name << ": changes before the first 'frame'" << std::endl;
+				return false;
+			}
+			else frames.back().push_back(line);
+		}
+		return true;
+	}
+
+	// the built-in motion over `count` frames, around the current sphere positions
+	void bob(const Scene &scene, int count)
+	{
+		bobFrames = count;
+		baseCenters.clear();
+		for (const Sphere &sphere : scene.spheres) baseCenters.push_back(sphere.center);
+	}
+
+	int frameCount() const
+	{
+		return bobFrames > 0 ? bobFrames : 1 + (int)frames.size();
+	}
+
+	// changes the scene from frame - 1 to frame (counted from 0)
+	bool apply(Scene &scene, int frame) const
+	{
+		if (bobFrames > 0) {
+			for (size_t i = 0; i < scene.spheres.size() && i < baseCenters.size(); ++i) {
+				if (scene.spheres[i].radius >= 100) continue;
+				float phase = 2 * (float)M_PI * frame / bobFrames + (float)i;
+				scene.spheres[i].center = baseCenters[i] + Vector3f(0, 0.5f * scene.spheres[i].radius * (1 + std::sin(phase)), 0);
+			}
+			return true;
+		}
+
+		for (const std::string &line : frames[frame - 1]) {
+			std::istringstream ls(line);
+			std::string keyword, kind;
+			int index = -1;
+			ls >> keyword;
+			if (keyword == "color") ls >> kind;
+			bool ok = keyword == "phong" || (ls >> index && index >= 0);
+			if (ok && keyword == "phong") {
+				ok = (bool)(ls >> scene.kd >> scene.ks >> scene.alpha);
+			}
+			else if (ok && keyword == "sphere") {
+				Vector3f center;
+				ok = (bool)(ls >> center(0) >> center(1) >> center(2)) && index < (int)scene.spheres.size();
+				if (ok) scene.spheres[index].center = center;
+			}
+			else if (ok && keyword == "instance") {
+				Vector3f translation;
+				Matrix3f linear = Matrix3f::Identity();
+				ok = (bool)(ls >> translation(0) >> translation(1) >> translation(2)) && index < (int)scene.instances.size();
+				if (ok && ls >> linear(0, 0)) {
+					for (int k = 1; ok && k < 9; ++k) ok = (bool)(ls >> linear(k / 3, k % 3));
+				}
+				if (ok) scene.instances[index].setTransform(linear, translation);
+			}
+			else if (ok && keyword == "vertices") {
+				std::string path;
+				TriangleMesh pose;
+				ok = (bool)(ls >> path) && index < (int)scene.meshes.size();
+				if (ok && path[0] != '/' && path[0] != '\\' && path.find(':') == std::string::npos) path = directory + path;
+				ok = ok && loadObj(path, pose) && pose.vertices.size() == scene.meshes[index].vertices.size();
+				if (ok) {
+					TriangleMesh &mesh = scene.meshes[index];
+					for (size_t v = 0; v < pose.vertices.size(); ++v) mesh.vertices[v] = pose.vertices[v] * mesh.scale + mesh.offset;
+				}
+			}
+			else if (ok && keyword == "light") {
+				std::vector<Vector3f> cluster;
+				Vector3f p;
+				while (ls >> p(0) >> p(1) >> p(2)) cluster.push_back(p);
+				ok = !cluster.empty() && index <= (int)scene.lights.size();
+				if (ok && index == (int)scene.lights.size()) scene.lights.push_back(cluster);
+				else if (ok) scene.lights[index] = cluster;
+			}
+			else if (ok && keyword == "color") {
+				Vector3f color;
+				ok = (bool)(ls >> color(0) >> color(1) >> color(2));
+				if (ok && kind == "sphere" && index < (int)scene.spheres.size()) scene.spheres[index].surfaceColor = color;
+				else if (ok && kind == "mesh" && index < (int)scene.meshes.size()) scene.meshes[index].surfaceColor = color;
+				else ok = false;
+			}
+			else {
+				ok = false;
+			}
+			if (!ok) {
+				std::cerr << file << ": frame " << frame + 1 << ": cannot apply '" << line << "'" << std::endl;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// what the changes before `frame` touch, as FrameChange flags
+	int changes(int frame) const
+	{
+		if (bobFrames > 0) return CHANGE_GEOMETRY;
+		int result = 0;
+		for (const std::string &line : frames[frame - 1]) {
+			std::istringstream ls(line);
+			std::string keyword;
+			ls >> keyword;
+			result |= keyword == "light" || keyword == "color" || keyword == "phong" ? CHANGE_LIGHTING : CHANGE_GEOMETRY;
+		}
+		return result;
+	}
+
+	// appends the bounds of the objects that the changes before `frame` move, where they are in `scene`
+	void movedBounds(const Scene &scene, int frame, std::vector<AABB> &bounds) const
+	{
+		if (bobFrames > 0) {
+			for (size_t i = 0; i < scene.spheres.size(); ++i) {
+				if (scene.spheres[i].radius < 100) bounds.push_back(scene.sphereBox((int)i));
+			}
+			return;
+		}
+		for (const std::string &line : frames[frame - 1]) {
+			std::istringstream ls(line);
+			std::string keyword;
+			int index = -1;
+			ls >> keyword >> index;
+			if (keyword == "sphere" && index >= 0 && index < (int)scene.spheres.size()) bounds.push_back(scene.sphereBox(index));
+			else if (keyword == "instance" && index >= 0 && index < (int)scene.instances.size()) bounds.push_back(scene.instanceBox(index));
+			else if (keyword == "vertices") {
+				for (size_t i = 0; i < scene.instances.size(); ++i) {
+					if (scene.instances[i].mesh == index) bounds.push_back(scene.instanceBox((int)i));
+				}
+			}
+		}
+	}
+
+private:
+	std::string file, directory;
+	std::vector<std::vector<std::string>> frames; // statements before frames 2, 3, ...
+	int bobFrames = 0;
+	std::vector<Vector3f> baseCenters;
+};
+
+// Relighting: a frame that only changes the lights, the surface colours or the Phong constants sees the same
+// hits as the frame before. With --relight the camera ray of every pixel and its chain of mirror reflections
+// are traced once and kept, and such frames only redo the shading. Every bounce up to MAX_DEPTH is kept,
+// because how far trace() follows a path depends on its shading; shade() makes the same decisions as
+// trace() and gives the same pixels. Unless the light tree picks the clusters, the visibility of every
+// light sample is kept with the bounce too, so only clusters whose points changed get new shadow rays.
+// With --incremental, frames that move objects only trace the pixels whose kept rays the objects may
+// cross again (see update()).
+class RelightCache
+{
+public:
+	// traces and keeps the hits of the pixel centres
+	void record(const Scene &scene, ThreadPool &pool)
+	{
+		width = scene.camera.width;
+		rows.resize(scene.camera.height);
+		first.resize((size_t)width * rows.size());
+		pool.parallelFor((int)rows.size(), [&](int y) {
+			std::vector<Bounce> &row = rows[y];
+			row.clear();
+			for (unsigned x = 0; x < width; ++x) {
+				first[(size_t)y * width + x] = (unsigned)row.size();
+				recordPath(scene, x, y, row);
+			}
+			row.shrink_to_fit();
+			flushRayCounts();
+		});
+		visibilityLights.clear();
+		visibilityCounts.clear();
+		visibility.clear();
+	}
+
+	// shades the kept hits with the scene's current lights, colours and Phong constants into `image`
+	void shade(const Scene &scene, Vector3f *image, ThreadPool &pool)
+	{
+		bool keepVisibility = beginPass(scene);
+		pool.parallelFor((int)rows.size(), [&](int y) {
+			for (unsigned x = 0; x < width; ++x) image[(size_t)y * width + x] = shadePixel(scene, x, y, keepVisibility);
+			flushRayCounts();
+		});
+	}
+
+	// brings the cache and `image` up to date after objects moved, `moved` holding their bounds before and
+	// after the move. A pixel can only change if one of its kept rays, from the camera, along a reflection or
+	// towards a light sample, enters one of the boxes: those pixels are traced and shaded again, and the others
+	// are copied from the previous frame's image. Returns the number of pixels traced again.
+	size_t update(const Scene &scene, const std::vector<AABB> &moved, const Vector3f *previous, Vector3f *image, ThreadPool &pool)
+	{
+		// the boxes are padded for the rounding of the hit distances
+		std::vector<AABB> boxes;
+		for (const AABB &box : moved) {
+			Vector3f pad = Vector3f::Constant(1e-3f) + 1e-4f * box.min.cwiseAbs().cwiseMax(box.max.cwiseAbs());
+			boxes.push_back(AABB(box.min - pad, box.max + pad));
+		}
+
+		std::vector<Ball> boxBalls, lightBalls;
+		for (const AABB &box : boxes) boxBalls.push_back(Ball{ box.centroid(), 0.5f * (box.max - box.min).norm() });
+		for (const std::vector<Vector3f> &cluster : scene.lights) {
+			AABB box;
+			for (const Vector3f &light : cluster) box.grow(light);
+			lightBalls.push_back(Ball{ box.centroid(), 0.5f * (box.max - box.min).norm() });
+		}
+
+		std::vector<char> dirty((size_t)width * rows.size());
+		std::atomic<size_t> dirtyCount(0);
+		pool.parallelFor((int)rows.size(), [&](int y) {
+			size_t count = 0;
+			for (unsigned x = 0; x < width; ++x) {
+				size_t i = (size_t)y * width + x;
+				dirty[i] = !boxes.empty() && crosses(scene, &rows[y][first[i]], boxes, boxBalls, lightBalls);
+				count += dirty[i];
+			}
+			dirtyCount += count;
+		});
+
+		bool keepVisibility = beginPass(scene);
+		pool.parallelFor((int)rows.size(), [&](int y) {
+			size_t begin = (size_t)y * width;
+			if (std::find(dirty.begin() + begin, dirty.begin() + begin + width, 1) == dirty.begin() + begin + width) {
+				std::copy(previous + begin, previous + begin + width, image + begin);
+				return;
+			}
+
+			// the row is put together anew from the kept paths of its clean pixels and new paths for the others
+			std::vector<Bounce> row;
+			std::vector<uint64_t> bits;
+			std::vector<unsigned> stamps;
+			for (unsigned x = 0; x < width; ++x) {
+				size_t i = begin + x;
+				size_t start = first[i];
+				size_t end = x + 1 < width ? first[i + 1] : rows[y].size();
+				first[i] = (unsigned)row.size();
+				if (dirty[i]) {
+					recordPath(scene, x, y, row);
+					if (keepVisibility) {
+						bits.resize(row.size() * words, 0);
+						stamps.resize(row.size(), 0);
+					}
+				}
+				else {
+					row.insert(row.end(), rows[y].begin() + start, rows[y].begin() + end);
+					if (keepVisibility) {
+						bits.insert(bits.end(), visibility[y].begin() + start * words, visibility[y].begin() + end * words);
+						stamps.insert(stamps.end(), updated[y].begin() + start, updated[y].begin() + end);
+					}
+				}
+			}
+			row.shrink_to_fit();
+			bits.shrink_to_fit();
+			stamps.shrink_to_fit();
+			rows[y].swap(row);
+			if (keepVisibility) {
+				visibility[y].swap(bits);
+				updated[y].swap(stamps);
+			}
+
+			for (unsigned x = 0; x < width; ++x) {
+				size_t i = begin + x;
+				image[i] = dirty[i] ? shadePixel(scene, x, y, keepVisibility) : previous[i];
+			}
+			flushRayCounts();
+		});
+		return dirtyCount;
+	}
+
+	// bytes held by the cache
+	size_t memory() const
+	{
+		size_t bytes = first.size() * sizeof(unsigned);
+		for (const std::vector<Bounce> &row : rows) bytes += row.capacity() * sizeof(Bounce);
+		for (const std::vector<uint64_t> &row : visibility) bytes += row.capacity() * sizeof(uint64_t);
+		for (const std::vector<unsigned> &row : updated) bytes += row.capacity() * sizeof(unsigned);
+		return bytes;
+	}
+
+private:
+	// a hit along a pixel's path, as trace() sees it. A ray that leaves the scene ends the path with a bounce
+	// that has neither a sphere nor an instance, and only its view direction set; its point and normal stay zero.
+	struct Bounce
+	{
+		Hit hit;
+		Vector3f point = Vector3f::Zero();
+		Vector3f normal = Vector3f::Zero();
+		Vector3f view;
+
+		bool missed() const
+		{
+			return hit.sphere < 0 && hit.instance < 0;
+		}
+	};
+
+	// bounding sphere
+	struct Ball
+	{
+		Vector3f centre;
+		float radius;
+	};
+
+	unsigned width = 0;
+	std::vector<std::vector<Bounce>> rows; // the paths of each image row, one after the other
+	std::vector<unsigned> first;           // per pixel, its first bounce in the row
+	std::vector<std::vector<uint64_t>> visibility; // per row, `words` words of sample visibility bits per bounce
+	std::vector<std::vector<unsigned>> updated;    // per row, the pass that last updated each bounce's bits (0: none)
+	std::vector<std::vector<Vector3f>> visibilityLights; // the clusters of the last pass
+	std::vector<int> visibilityCounts;     // samples of each of those clusters
+	std::vector<int> sampleOffset;         // first bit of each cluster
+	std::vector<unsigned> changed;         // per cluster, the pass that last changed its points
+	unsigned pass = 0;
+	int words = 0;
+
+	// appends the camera ray of pixel (x, y) and its mirror reflections, as far as trace() could follow them
+	void recordPath(const Scene &scene, unsigned x, unsigned y, std::vector<Bounce> &row) const
+	{
+		Vector3f origin = scene.camera.position;
+		Vector3f direction = scene.camera.rayDirection(x + 0.5f, y + 0.5f);
+		for (int depth = 0;; ++depth) {
+			if (depth == 0) threadRays.primary++;
+			else threadRays.reflection++;
+
+			Bounce bounce;
+			bounce.view = -direction;
+			if (!scene.intersect(origin, direction, -0.1f, bounce.hit)) {
+				row.push_back(bounce);
+				return;
+			}
+			bounce.point = origin + bounce.hit.t * direction;
+			bounce.normal = scene.normal(bounce.hit, bounce.point, direction);
+			row.push_back(bounce);
+			if (depth + 1 > MAX_DEPTH || !scene.specular(bounce.hit)) return;
+			direction = reflect(direction, bounce.normal);
+			origin = bounce.point;
+		}
+	}
+
+	// starts a shading pass and returns whether it keeps the visibility bits. They stay valid for the clusters
+	// whose points are the same, as long as every cluster has as many samples as before. A path may reach
+	// bounces it did not reach in the passes since they were updated, so every bounce has the pass that last
+	// updated it, and every cluster the pass that last changed it.
+	bool beginPass(const Scene &scene)
+	{
+		if (options.lightTreeSamples > 0 || options.lightCull > 0) return false;
+
+		++pass;
+		std::vector<int> counts;
+		for (const std::vector<Vector3f> &cluster : scene.lights) counts.push_back(lightSampleCount(cluster));
+		if (counts != visibilityCounts || rows.size() != visibility.size()) {
+			visibilityCounts = counts;
+			visibilityLights.clear();
+			sampleOffset.clear();
+			int total = 0;
+			for (int count : counts) {
+				sampleOffset.push_back(total);
+				total += count;
+			}
+			words = (total + 63) / 64;
+			visibility.resize(rows.size());
+			updated.resize(rows.size());
+			for (size_t y = 0; y < rows.size(); ++y) {
+				visibility[y].assign(rows[y].size() * words, 0);
+				updated[y].assign(rows[y].size(), 0);
+			}
+		}
+		changed.resize(scene.lights.size());
+		for (size_t j = 0; j < scene.lights.size(); ++j) {
+			if (j >= visibilityLights.size() || scene.lights[j] != visibilityLights[j]) changed[j] = pass;
+		}
+		visibilityLights = scene.lights;
+		return true;
+	}
+
+	// colour of pixel (x, y) from its kept path, making the same decisions as trace()
+	Vector3f shadePixel(const Scene &scene, unsigned x, unsigned y, bool keepVisibility)
+	{
+		seedPath(x, y, 0);
+		size_t start = first[(size_t)y * width + x];
+		const Bounce *path = &rows[y][start];
+		Vector3f color[MAX_DEPTH + 1];
+		float factor[MAX_DEPTH + 1];
+		bool blended[MAX_DEPTH + 1];
+		int bounces = 0;
+		bool missed = false;
+		Vector3f prefix = Vector3f::Zero();
+		float weight = 1.f;
+		while (true) {
+			const Bounce &bounce = path[bounces];
+			if (bounce.missed()) {
+				missed = true;
+				break;
+			}
+			int k = bounces++;
+			if (keepVisibility) color[k] = cachedDirectLight(scene, bounce, &visibility[y][(start + k) * words], updated[y][start + k], k);
+			else color[k] = directLight(scene, scene.surfaceColor(bounce.hit), bounce.point, bounce.normal, bounce.view, k);
+			factor[k] = 0.f;
+			blended[k] = false;
+			if (k + 1 > MAX_DEPTH || !scene.specular(bounce.hit)) break;
+
+			blended[k] = true;
+			Vector3f childPrefix;
+			float childWeight, childFactor;
+			if (!continuePath(scene, prefix, weight, color[k], pathRandom, childPrefix, childWeight, childFactor)) break;
+			factor[k] = childFactor;
+			prefix = childPrefix;
+			weight = childWeight;
+		}
+		return foldPath(scene, color, factor, blended, bounces, missed);
+	}
+
+	// directLight() of every cluster, with the visibility of the samples taken from `bits`, and traced into
+	// them first for the clusters that changed since the bounce was last updated
+	Vector3f cachedDirectLight(const Scene &scene, const Bounce &bounce, uint64_t *bits, unsigned &bounceUpdated, int depth) const
+	{
+		const Vector3f &surfaceColor = scene.surfaceColor(bounce.hit);
+		Vector3f pixelColor = Vector3f::Zero();
+		std::vector<signed char> &visible = sampleVisibility;
+		for (int j = 0; j < (int)scene.lights.size(); ++j) {
+			const std::vector<Vector3f> &cluster = scene.lights[j];
+			int samples = lightSampleCount(cluster);
+			int offset = sampleOffset[j];
+			if (changed[j] > bounceUpdated) {
+				clusterVisibility(scene, j, bounce.point, depth, visible);
+				for (int s = 0; s < samples; ++s) {
+					uint64_t bit = 1ull << ((offset + s) % 64);
+					if (visible[s]) bits[(offset + s) / 64] |= bit;
+					else bits[(offset + s) / 64] &= ~bit;
+				}
+			}
+			else {
+				visible.resize(samples);
+				for (int s = 0; s < samples; ++s) visible[s] = bits[(offset + s) / 64] >> ((offset + s) % 64) & 1;
+			}
+			PROFILE_STAGE(depth, STAGE_SHADE);
+			clusterShader(scene, samples)(scene, j, visible.data(), surfaceColor, bounce.point, bounce.normal, bounce.view, 1.f, pixelColor);
+		}
+		bounceUpdated = pass;
+		return pixelColor;
+	}
+
+	// whether a kept path has a ray that enters one of the boxes: the ray to each bounce, and from each hit the
+	// shadow rays towards every sample of every light cluster, which trace() tests all the way. The shadow
+	// rays towards a cluster are only tested against a box if the cones from the hit around the cluster's
+	// and the box's bounding spheres overlap.
+	bool crosses(const Scene &scene, const Bounce *path, const std::vector<AABB> &boxes, const std::vector<Ball> &boxBalls, const std::vector<Ball> &lightBalls) const
+	{
+		Vector3f origin = scene.camera.position;
+		for (int k = 0;; ++k) {
+			const Bounce &bounce = path[k];
+			Vector3f direction = -bounce.view;
+			Vector3f invDirection = direction.cwiseInverse();
+			float tMax = bounce.missed() ? INFINITY : bounce.hit.t;
+			for (const AABB &box : boxes) {
+				if (rayCrosses(origin, direction, invDirection, tMax, box)) return true;
+			}
+			if (bounce.missed()) return false;
+
+			for (size_t j = 0; j < scene.lights.size(); ++j) {
+				const std::vector<Vector3f> &cluster = scene.lights[j];
+				int samples = lightSampleCount(cluster);
+				for (size_t b = 0; b < boxes.size(); ++b) {
+					if (!conesOverlap(bounce.point, lightBalls[j], boxBalls[b])) continue;
+					for (int s = 0; s < samples; ++s) {
+						Vector3f toLight = lightSample(cluster, s, samples, bounce.point) - bounce.point;
+						toLight.normalize();
+						if (rayCrosses(bounce.point, toLight, toLight.cwiseInverse(), INFINITY, boxes[b])) return true;
+					}
+				}
+			}
+			if (k + 1 > MAX_DEPTH || !scene.specular(bounce.hit)) return false;
+			origin = bounce.point;
+		}
+	}
+
+	// whether the ray along the unit direction enters the box before tMax. Hits are accepted a little behind
+	// the origin, so the ray starts a unit further back.
+	static bool rayCrosses(const Vector3f &origin, const Vector3f &direction, const Vector3f &invDirection, float tMax, const AABB &box)
+	{
+		float tNear;
+		return box.intersect(origin - direction, invDirection, tMax + 1, tNear);
+	}
+
+	// whether the cones of directions from p towards two balls may overlap
+	static bool conesOverlap(const Vector3f &p, const Ball &a, const Ball &b)
+	{
+		Vector3f toA = a.centre - p;
+		Vector3f toB = b.centre - p;
+		float distanceA = toA.norm();
+		float distanceB = toB.norm();
+		// a unit of slack for the ray start in rayCrosses()
+		if (distanceA <= a.radius + 1 || distanceB <= b.radius + 1) return true;
+		float cosAngle = toA.dot(toB) / (distanceA * distanceB);
+		float angle = std::acos(std::max(-1.f, std::min(1.f, cosAngle)));
+		return angle <= std::asin(a.radius / distanceA) + std::asin((b.radius + 1) / distanceB) + 1e-3f;
+	}
+};
+
+// output name of a frame: the frame number, from 1, goes before the extension ("render.ppm" -> "render001.ppm")
+std::string framePath(const std::string &path, int frame)
+{
+	char number[16];
+	std::snprintf(number, sizeof(number), "%03d", frame);
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return path + number;
+	return path.substr(0, dot) + number + path.substr(dot);
+}
+
+// renders every frame of the animation. The acceleration structures are refitted between frames that move
+// something, and the image of frame N is written on a thread of its own while frame N + 1 is updated and
+// traced. With --relight, frames that only change the lighting are shaded from the RelightCache, and with
+// --incremental, frames that only move objects trace just the pixels the objects may have changed.
+void renderSequence(Scene &scene, ThreadPool &pool, const Animation &animation)
+{
+	unsigned width = scene.camera.width;
+	unsigned height = scene.camera.height;
+	std::vector<Vector3f> images[2];
+	std::thread writer;
+	std::atomic<bool> ok(true);
+	RelightCache cache;
+	bool useCache = options.relight || options.incremental;
+
+	for (int frame = 0; frame < animation.frameCount() && ok; ++frame) {
+		auto start = std::chrono::steady_clock::now();
+		int rebuilt = 0;
+		int changes = frame == 0 ? CHANGE_GEOMETRY | CHANGE_LIGHTING : animation.changes(frame);
+		bool moved = (changes & CHANGE_GEOMETRY) != 0;
+		bool incremental = options.incremental && changes == CHANGE_GEOMETRY;
+		std::vector<AABB> movedBounds; // before and after the move
+		if (frame > 0) {
+			if (incremental) animation.movedBounds(scene, frame, movedBounds);
+			if (!animation.apply(scene, frame)) break;
+			if (moved) rebuilt = scene.update(options.refitThreshold);
+			if (incremental) animation.movedBounds(scene, frame, movedBounds);
+			scene.prepareLighting();
+		}
+		double update = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::vector<Vector3f> &image = images[frame % 2];
+		image.resize((size_t)width * height);
+		frameRays = RayCounts();
+		size_t retraced = 0;
+		if (!useCache) {
+			renderImage(scene, image.data(), pool);
+		}
+		else if (incremental) {
+			retraced = cache.update(scene, movedBounds, images[(frame + 1) % 2].data(), image.data(), pool);
+		}
+		else {
+			if (moved || !options.relight) cache.record(scene, pool);
+			cache.shade(scene, image.data(), pool);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// the other buffer is free once the previous frame has been written
+		if (writer.joinable()) writer.join();
+		std::string path = framePath(options.output, frame + 1);
+		writer = std::thread([&image, &ok, path, width, height]() {
+			ImageWriter out;
+			if (out.open(path, width, height)) {
+				out.writeRows(0, height, image.data());
+				if (out.close()) return;
+			}
+			std::cerr << "cannot write " << path << std::endl;
+			ok = false;
+		});
+
+		std::cout << "frame " << frame + 1 << ": update " << update * 1000 << " ms";
+		if (frame > 0) std::cout << (!moved ? " (lighting only)" : rebuilt ? " (" + std::to_string(rebuilt) + " BVHs rebuilt)" : " (refit)");
+		std::cout << ", frame " << seconds << " s";
+		if (options.relight && !moved) std::cout << " relit from the cache";
+		if (incremental) std::cout << ", " << retraced << " pixels traced again";
+		if (options.stats) std::cout << ", " << frameRays.total() << " rays";
+		if (options.stats && useCache && moved) std::cout << ", cache " << cache.memory() / (1 << 20) << " MB";
+		std::cout << std::endl;
+	}
+	if (writer.joinable()) writer.join();
+}
+
+// Render server: with --serve the process keeps scenes and their BVHs in memory and renders them on request,
+// so repeated renders, e.g. of one scene from several viewpoints, only pay for tracing. Given "-" it reads
+// commands from stdin and answers on stdout (log messages go to stderr); given a path it listens on a Unix
+// socket there and serves each connection on a thread of its own, until SIGINT or SIGTERM. Renders of
+// different scenes run at the same time and share the worker pool; requests for one scene take turns.
+// Renders use the rendering options of the command line.
+//
+// Every command is a line and is answered by a line "ok ..." or "error MESSAGE":
+//
+//   load NAME FILE                    loads a text or binary scene file and keeps it as NAME, replacing any
+//                                     scene of that name
+//   scene NAME BYTES                  the same for a text scene of BYTES bytes following the line; mesh files
+//                                     are relative to the server's working directory
+//   camera NAME WIDTH HEIGHT FOV [X Y Z TX TY TZ]
+//                                     as in a scene file; without a target the viewpoint is kept
+//   update NAME LINES                 applies the LINES animation statements following the line (sphere,
+//                                     instance, vertices, light, color, phong), refitting the BVHs if needed
+//   render NAME [ppm|pfm]             renders the scene; the answer is "ok BYTES SECONDS", followed by the
+//                                     image file of BYTES bytes
+//   drop NAME                         forgets the scene
+//   quit                              ends the connection
+
+#ifndef _WIN32
+// a connection read line by line, over one socket or over stdin and stdout
+class ServerConnection
+{
+public:
+	ServerConnection(int in, int out) : in(in), out(out) {}
+
+	bool readLine(std::string &line)
+	{
+		size_t end;
+		while ((end = buffer.find('\n')) == std::string::npos) {
+			if (!fill()) return false;
+		}
+		line = buffer.substr(0, end);
+		buffer.erase(0, end + 1);
+		if (!line.empty() && line.back() == '\r') line.pop_back();
+		return true;
+	}
+
+	bool readBytes(size_t size, std::string &data)
+	{
+		while (buffer.size() < size) {
+			if (!fill()) return false;
+		}
+		data = buffer.substr(0, size);
+		buffer.erase(0, size);
+		return true;
+	}
+
+	bool send(const std::string &data)
+	{
+		return writeAll(out, data.data(), data.size());
+	}
+
+private:
+	int in, out;
+	std::string buffer; // read and not yet consumed
+
+	bool fill()
+	{
+		char chunk[1 << 16];
+		ssize_t n;
+		do n = read(in, chunk, sizeof(chunk));
+		while (n < 0 && errno == EINTR);
+		if (n <= 0) return false;
+		buffer.append(chunk, n);
+		return true;
+	}
+};
+
+class RenderServer
+{
+public:
+	explicit RenderServer(ThreadPool &pool) : pool(pool) {}
+
+	// answers the commands of a connection until it ends or quits
+	void serve(ServerConnection &connection)
+	{
+		std::string line;
+		while (connection.readLine(line)) {
+			std::istringstream ls(line);
+			std::string command, name;
+			if (!(ls >> command)) continue;
+			if (command == "quit") return;
+
+			std::string image;
+			std::string answer = (ls >> name) ? handle(command, name, ls, connection, image) : "error no scene name";
+			if (!connection.send(answer + "\n" + image)) return;
+		}
+	}
+
+	// serves the connections to a Unix socket at `path` until SIGINT or SIGTERM
+	bool listen(const std::string &path)
+	{
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) {
+			std::cerr << "socket path too long: " << path << std::endl;
+			return false;
+		}
+		std::memcpy(address.sun_path, path.c_str(), path.size());
+		int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(path.c_str());
+		if (listener < 0 || bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 16) != 0) {
+			std::cerr << "cannot listen on " << path << std::endl;
+			if (listener >= 0) close(listener);
+			return false;
+		}
+		std::cout << "listening on " << path << std::endl;
+
+		// the accept loop wakes up regularly to notice a stop request
+		stopRequested = 0;
+		signal(SIGINT, requestStop);
+		signal(SIGTERM, requestStop);
+		while (!stopRequested) {
+			reapConnections();
+			pollfd fd = { listener, POLLIN, 0 };
+			if (poll(&fd, 1, 200) <= 0) continue;
+			int client = accept(listener, NULL, NULL);
+			if (client < 0) continue;
+			std::lock_guard<std::mutex> lock(connectionsMutex);
+			connections.push_back(std::unique_ptr<Connection>(new Connection{ client, std::thread(), false }));
+			Connection *entry = connections.back().get();
+			entry->thread = std::thread([this, entry] {
+				ServerConnection connection(entry->fd, entry->fd);
+				serve(connection);
+				std::lock_guard<std::mutex> lock(connectionsMutex);
+				close(entry->fd);
+				entry->finished = true;
+			});
+		}
+		close(listener);
+		unlink(path.c_str());
+
+		// ends the connections once their current command is answered; the threads are joined before the
+		// server goes away
+		{
+			std::lock_guard<std::mutex> lock(connectionsMutex);
+			for (const std::unique_ptr<Connection> &entry : connections) {
+				if (!entry->finished) shutdown(entry->fd, SHUT_RD);
+			}
+		}
+		for (const std::unique_ptr<Connection> &entry : connections) entry->thread.join();
+		connections.clear();
+		return true;
+	}
+
+private:
+	struct ServedScene
+	{
+		std::mutex mutex; // held by every request for the scene
+		Scene scene;
+	};
+
+	ThreadPool &pool;
+	std::map<std::string, std::shared_ptr<ServedScene>> scenes;
+	std::mutex scenesMutex;
+	std::mutex denoiseMutex; // the denoiser's feature buffers are shared by all renders
+	// a connection to the socket, served on a thread of its own
+	struct Connection
+	{
+		int fd;
+		std::thread thread;
+		bool finished; // set under connectionsMutex as the thread's last step; the socket is closed
+	};
+	std::vector<std::unique_ptr<Connection>> connections; // added and removed by the accept loop only
+	std::mutex connectionsMutex;
+
+	// joins the threads of the connections that have ended
+	void reapConnections()
+	{
+		std::lock_guard<std::mutex> lock(connectionsMutex);
+		for (auto entry = connections.begin(); entry != connections.end();) {
+			if ((*entry)->finished) {
+				(*entry)->thread.join();
+				entry = connections.erase(entry);
+			}
+			else {
+				++entry;
+			}
+		}
+	}
+
+	std::shared_ptr<ServedScene> find(const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(scenesMutex);
+		auto found = scenes.find(name);
+		return found == scenes.end() ? nullptr : found->second;
+	}
+
+	// runs one command on scene `name`; an image to send after the answer is stored in `image`
+	std::string handle(const std::string &command, const std::string &name, std::istream &ls, ServerConnection &connection, std::string &image)
+	{
+		if (command == "load" || command == "scene") {
+			std::shared_ptr<ServedScene> served = std::make_shared<ServedScene>();
+			Scene &scene = served->scene;
+			bool ok;
+			if (command == "load") {
+				std::string file;
+				if (!(ls >> file)) return "error no scene file";
+				ok = loadScene(file, scene);
+			}
+			else {
+				size_t size;
+				std::string text;
+				if (!(ls >> size)) return "error no scene size";
+				if (!connection.readBytes(size, text)) return "error scene truncated";
+				std::istringstream in(text);
+				ok = loadSceneText(in, "scene " + name, "", scene);
+			}
+			if (!ok) return "error cannot load scene " + name;
+			if (scene.mapping) {
+				scene.buildObjects();
+				scene.prepare(options.simd);
+			}
+			else {
+				scene.build(options.simd);
+			}
+			std::lock_guard<std::mutex> lock(scenesMutex);
+			scenes[name] = served;
+			return "ok";
+		}
+		if (command == "drop") {
+			std::lock_guard<std::mutex> lock(scenesMutex);
+			return scenes.erase(name) ? "ok" : "error no scene " + name;
+		}
+
+		if (command == "update") {
+			// the statements are read before the scene is looked up, so that the connection stays in step
+			int count;
+			if (!(ls >> count) || count < 0) return "error no statement count";
+			std::string text = "frame\n", line;
+			for (int i = 0; i < count; ++i) {
+				if (!connection.readLine(line)) return "error update truncated";
+				text += line + "\n";
+			}
+			std::shared_ptr<ServedScene> served = find(name);
+			if (!served) return "error no scene " + name;
+			Animation update;
+			std::istringstream in(text);
+			if (!update.read(in, "update of " + name, "")) return "error cannot parse update";
+
+			std::lock_guard<std::mutex> lock(served->mutex);
+			Scene &scene = served->scene;
+			// a statement that fails leaves the ones before it applied, so the scene is brought up to date anyway
+			bool ok = update.apply(scene, 1);
+			if (update.changes(1) & CHANGE_GEOMETRY) scene.update(options.refitThreshold);
+			scene.prepareLighting();
+			return ok ? "ok" : "error cannot apply update";
+		}
+
+		std::shared_ptr<ServedScene> served = find(name);
+		if (!served) return "error no scene " + name;
+		std::lock_guard<std::mutex> lock(served->mutex);
+		Scene &scene = served->scene;
+		if (command == "camera") {
+			Camera camera = scene.camera;
+			if (!readCamera(ls, camera)) return "error cannot parse camera";
+			scene.camera = camera;
+			return "ok";
+		}
+		if (command == "render") {
+			std::string format;
+			if (!(ls >> format)) format = "ppm";
+			if (format != "ppm" && format != "pfm") return "error unknown image format " + format;
+
+			auto start = std::chrono::steady_clock::now();
+			scene.setOutput(format == "pfm");
+			std::vector<Vector3f> pixels((size_t)scene.camera.width * scene.camera.height);
+			{
+				std::unique_lock<std::mutex> denoising(denoiseMutex, std::defer_lock);
+				if (options.denoiseIterations > 0) denoising.lock();
+				renderDenoised(scene, pixels.data(), pool);
+			}
+			image = encodeImage(pixels.data(), scene.camera.width, scene.camera.height, format == "pfm");
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			return "ok " + std::to_string(image.size()) + " " + std::to_string(seconds);
+		}
+		return "error unknown command " + command;
+	}
+};
+#endif
+
+// runs the render server on a Unix socket at `path`, or on stdin and stdout for "-"
+bool serve(const std::string &path, ThreadPool &pool)
+{
+#ifdef _WIN32
+	std::cerr << "the render server is not supported on Windows" << std::endl;
+	return false;
+#else
+	// a client that goes away must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	RenderServer server(pool);
+	if (path != "-") return server.listen(path);
+
+	// stdout carries the answers, so the log goes to stderr
+	std::cout.flush();
+	std::streambuf *log = std::cout.rdbuf(std::cerr.rdbuf());
+	ServerConnection connection(0, 1);
+	server.serve(connection);
+	std::cout.rdbuf(log);
+	return true;
+#endif
+}
+
+// Scene generators, used for the command line scenes and the benchmarks.
+
+// the spheres of the original assignment scene, optionally without the big red one
+void addDefaultSpheres(Scene &scene, bool redSphere = true)
+{
+	std::vector<Sphere> &spheres = scene.spheres;
+	// position, radius, surface color
+	spheres.push_back(Sphere(Vector3f(0.0, -10004, -20), 10000, Vector3f(0.50, 0.50, 0.50), true));
+	if (redSphere) spheres.push_back(Sphere(Vector3f(0.0, 0, -20), 4, Vector3f(1.00, 0.32, 0.36), true));
+	spheres.push_back(Sphere(Vector3f(5.0, -1, -15), 2, Vector3f(0.90, 0.76, 0.46), true));
+	spheres.push_back(Sphere(Vector3f(5.0, 0, -25), 3, Vector3f(0.65, 0.77, 0.97), true));
+	spheres.push_back(Sphere(Vector3f(-5.5, 0, -13), 3, Vector3f(0.90, 0.90, 0.90), true));
+	spheres.push_back(Sphere(Vector3f(3.5, 3, -13), 1, Vector3f(1.00, 1.00, 0.00), true));
+	spheres.push_back(Sphere(Vector3f(-1.5, -1.5, -10), 0.5, Vector3f(0.00, 0.50, 1.00), false));
+}
+
+// a field of small spheres resting on the ground in front of the camera, for large-scene timings
+void addRandomSpheres(Scene &scene, unsigned count)
+{
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<float> uniform(0.f, 1.f);
+	for (unsigned i = 0; i < count; ++i) {
+		float r = 0.05f + 0.1f * uniform(rng);
+		Vector3f center(-20 + 40 * uniform(rng), -4 + r, -60 + 50 * uniform(rng));
+		Vector3f color(uniform(rng), uniform(rng), uniform(rng));
+		scene.spheres.push_back(Sphere(center, r, color, uniform(rng) < 0.3f));
+	}
+}
+
+// replaces the lights with single-point lights scattered over a slab above and around the spheres,
+// standing in for a field of small emitters
+void setRandomLights(Scene &scene, unsigned count)
+{
+	if (count == 0) return;
+	std::mt19937 rng(13);
+	std::uniform_real_distribution<float> uniform(0.f, 1.f);
+	scene.lights.clear();
+	for (unsigned i = 0; i < count; ++i) {
+		Vector3f position(-60 + 120 * uniform(rng), 5 + 55 * uniform(rng), -70 + 130 * uniform(rng));
+		scene.lights.push_back(std::vector<Vector3f>(1, position));
+	}
+}
+
+// scales a mesh to the size of the built-in scene's red sphere and stands it on the ground where that sphere is
+void placeMesh(TriangleMesh &mesh)
+{
+	AABB box = mesh.bounds();
+	float s = 4.f / (0.5f * (box.max - box.min).norm());
+	Vector3f base(box.centroid()(0), box.min(1), box.centroid()(2));
+	mesh.transform(s, Vector3f(0, -4, -20) - s * base);
+}
+
+// adds a mesh in the red sphere's place and colour
+void addPlacedMesh(Scene &scene, TriangleMesh &&mesh)
+{
+	placeMesh(mesh);
+	mesh.surfaceColor = Vector3f(1.00, 0.32, 0.36);
+	mesh.specular = true;
+	scene.meshes.push_back(std::move(mesh));
+	scene.addInstance((int)scene.meshes.size() - 1, -1, Matrix3f::Identity(), Vector3f::Zero());
+}
+
+// a (2, 3) torus knot tube of 2 * segments * sides triangles, with normals computed at build time
+TriangleMesh makeTorusKnot(int segments, int sides)
+{
+	TriangleMesh mesh;
+	auto curve = [](float t) {
+		float r = 2 + std::cos(3 * t);
+		return Vector3f(r * std::cos(2 * t), r * std::sin(2 * t), -std::sin(3 * t));
+	};
+	for (int i = 0; i < segments; ++i) {
+		float t = 2 * (float)M_PI * i / segments;
+		Vector3f p = curve(t);
+		Vector3f tangent = (curve(t + 1e-3f) - p).normalized();
+		Vector3f binormal = tangent.cross(Vector3f::UnitZ()).normalized();
+		Vector3f normal = binormal.cross(tangent);
+		for (int j = 0; j < sides; ++j) {
+			float a = 2 * (float)M_PI * j / sides;
+			mesh.vertices.push_back(p + 0.5f * (std::cos(a) * normal + std::sin(a) * binormal));
+		}
+	}
+	for (int i = 0; i < segments; ++i) {
+		for (int j = 0; j < sides; ++j) {
+			int a = i * sides + j;
+			int b = (i + 1) % segments * sides + j;
+			int c = (i + 1) % segments * sides + (j + 1) % sides;
+			int d = i * sides + (j + 1) % sides;
+			mesh.triangles.push_back(Vector3i(a, b, c));
+			mesh.triangles.push_back(Vector3i(a, c, d));
+		}
+	}
+	mesh.file = "torus-knot";
+	return mesh;
+}
+
+// a crowd of small copies of one shared object on the ground: the last mesh, or else a group of spheres.
+// Every copy is an instance, so the geometry is stored once.
+void addInstances(Scene &scene, unsigned count)
+{
+	if (count == 0) return;
+	std::mt19937 instanceRng(11);
+	std::uniform_real_distribution<float> u01(0.f, 1.f);
+	int mesh = scene.meshes.empty() ? -1 : (int)scene.meshes.size() - 1;
+	int group = -1;
+	// the object's base point and size: a placed mesh stands at the red sphere's place with radius 4
+	Vector3f base(0, -4, -20);
+	float size = 4.f;
+	if (mesh < 0) {
+		scene.groups.emplace_back();
+		group = (int)scene.groups.size() - 1;
+		for (int k = 0; k < 16; ++k) {
+			float r = 0.1f + 0.15f * u01(instanceRng);
+			Vector3f center(-0.4f + 0.8f * u01(instanceRng), r + 0.4f * u01(instanceRng), -0.4f + 0.8f * u01(instanceRng));
+			Vector3f color(u01(instanceRng), u01(instanceRng), u01(instanceRng));
+			scene.groups[group].spheres.push_back(Sphere(center, r, color, u01(instanceRng) < 0.3f));
+		}
+		base = Vector3f::Zero();
+		size = 0.6f;
+	}
+	for (unsigned i = 0; i < count; ++i) {
+		float scale = (0.5f + 0.5f * u01(instanceRng)) / size;
+		Matrix3f linear = scale * AngleAxisf(2 * (float)M_PI * u01(instanceRng), Vector3f::UnitY()).toRotationMatrix();
+		Vector3f position(-20 + 40 * u01(instanceRng), -4, -60 + 50 * u01(instanceRng));
+		scene.addInstance(mesh, group, linear, position - linear * base);
+	}
+}
+
+// Benchmarks.
+
+// high-water mark of the resident memory of the process, in bytes
+size_t peakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+std::string jsonString(const std::string &text)
+{
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') quoted += '\\';
+		if ((unsigned char)c >= 0x20) quoted += c;
+	}
+	return quoted + "\"";
+}
+
+// a benchmark scene: its name and how to make it
+struct BenchmarkScene
+{
+	std::string name;
+	std::function<bool(Scene &)> make;
+};
+
+// renders every benchmark scene once with the current options (threads, SIMD, sampling) and writes the
+// timings, ray counts and intersection tests as JSON. Peak memory is the high-water mark of the whole
+// process, so the scenes run from small to large. A scene that cannot be made gets an entry with an error
+// and the rest still run; a results file is written next to its name and renamed into place at the end, so
+// a run that dies half way leaves no truncated JSON behind.
+bool runBenchmarks(const std::string &path, ThreadPool &pool)
+{
+	std::vector<BenchmarkScene> scenes = {
+		{ "spheres7", [](Scene &scene) { addDefaultSpheres(scene); return true; } },
+		{ "spheres1k", [](Scene &scene) { addDefaultSpheres(scene); addRandomSpheres(scene, 1000); return true; } },
+		{ "knot6k", [](Scene &scene) { addDefaultSpheres(scene, false); addPlacedMesh(scene, makeTorusKnot(160, 20)); return true; } },
+		{ "knot100k", [](Scene &scene) { addDefaultSpheres(scene, false); addPlacedMesh(scene, makeTorusKnot(1000, 50)); return true; } },
+		{ "spheres100k", [](Scene &scene) { addDefaultSpheres(scene); addRandomSpheres(scene, 100000); return true; } },
+		{ "spheres1M", [](Scene &scene) { addDefaultSpheres(scene); addRandomSpheres(scene, 1000000); return true; } },
+	};
+	for (const std::string &file : options.meshFiles) {
+		scenes.push_back(BenchmarkScene{ "mesh:" + file, [file](Scene &scene) {
+			TriangleMesh mesh;
+			if (!loadObj(file, mesh)) return false;
+			addDefaultSpheres(scene, false);
+			addPlacedMesh(scene, std::move(mesh));
+			return true;
+		} });
+	}
+
+	std::ofstream file;
+	std::string partial = path + ".partial";
+	if (path != "-") {
+		file.open(partial.c_str());
+		if (!file.is_open()) {
+			std::cerr << "cannot write " << partial << std::endl;
+			return false;
+		}
+	}
+	std::ostream &out = path == "-" ? std::cout : file;
+
+	out << "{\n  \"threads\": " << pool.size() << ",\n  \"scenes\": [";
+	bool first = true;
+	bool ok = true;
+	for (const BenchmarkScene &benchmark : scenes) {
+		if (!options.benchmarkScenes.empty() && ("," + options.benchmarkScenes + ",").find("," + benchmark.name + ",") == std::string::npos) continue;
+
+		Scene scene;
+		if (!benchmark.make(scene)) {
+			out << (first ? "\n" : ",\n") << "    {\n"
+				<< "      \"name\": " << jsonString(benchmark.name) << ",\n"
+				<< "      \"error\": \"cannot make the scene\"\n"
+				<< "    }";
+			first = false;
+			ok = false;
+			continue;
+		}
+		auto start = std::chrono::steady_clock::now();
+		scene.build(options.simd);
+		scene.setOutput(false);
+		double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::vector<Vector3f> image((size_t)scene.camera.width * scene.camera.height);
+		frameRays = RayCounts();
+		start = std::chrono::steady_clock::now();
+		renderImage(scene, image.data(), pool);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		size_t triangles = 0;
+		for (const TriangleMesh &mesh : scene.meshes) triangles += mesh.triangles.size();
+		double rays = (double)frameRays.total();
+		const char *simdNames[] = { "auto", "scalar", "sse", "avx2" };
+
+		out << (first ? "\n" : ",\n") << "    {\n"
+			<< "      \"name\": " << jsonString(benchmark.name) << ",\n"
+			<< "      \"spheres\": " << scene.spheres.size() << ",\n"
+			<< "      \"triangles\": " << triangles << ",\n"
+			<< "      \"width\": " << scene.camera.width << ",\n"
+			<< "      \"height\": " << scene.camera.height << ",\n"
+			<< "      \"simd\": \"" << simdNames[scene.simd] << "\",\n"
+			<< "      \"buildSeconds\": " << buildSeconds << ",\n"
+			<< "      \"renderSeconds\": " << seconds << ",\n"
+			<< "      \"raysPerSecond\": " << rays / seconds << ",\n"
+			<< "      \"primaryRays\": " << frameRays.primary << ",\n"
+			<< "      \"shadowRays\": " << frameRays.shadow << ",\n"
+			<< "      \"reflectionRays\": " << frameRays.reflection << ",\n"
+			<< "      \"nodeTestsPerRay\": " << (RT_COUNTERS ? std::to_string(frameRays.nodeTests / rays) : "null") << ",\n"
+			<< "      \"primitiveTestsPerRay\": " << (RT_COUNTERS ? std::to_string(frameRays.primitiveTests / rays) : "null") << ",\n"
+			<< "      \"peakMemoryBytes\": " << peakMemory() << "\n"
+			<< "    }";
+		out.flush();
+		first = false;
+	}
+	out << "\n  ]\n}" << std::endl;
+	if (!out) {
+		std::cerr << "cannot write " << (path == "-" ? "the results" : partial) << std::endl;
+		return false;
+	}
+	if (path != "-") {
+		file.close();
+		if (!file || std::rename(partial.c_str(), path.c_str()) != 0) {
+			std::cerr << "cannot write " << path << std::endl;
+			return false;
+		}
+	}
+	return ok;
+}
+
+void printUsage(const char *program)
+{
+	std::cerr << "usage: " << program << " [options]\n"
+		<< "  --threads N              worker threads (0: one per hardware thread)\n"
+		<< "  --tile SIZE              tile edge in pixels\n"
+		<< "  --scaling                print the speedup for 1..N threads\n"
+		<< "  --simd auto|scalar|sse|avx2\n"
+		<< "  --no-occluder-cache      do not test the last shadow blocker first\n"
+		<< "  --light-samples N        shadow samples per light cluster\n"
+		<< "  --light-probes N         probe samples per cluster before the rest\n"
+		<< "  --light-tree N           importance-sample N light clusters per hit with the light tree\n"
+		<< "  --light-cull T           skip light clusters whose bounded contribution is below T\n"
+		<< "  --random-lights N        replace the lights with N point lights\n"
+		<< "  --aa-samples N           adaptive supersampling, at most N samples per pixel\n"
+		<< "  --aa-threshold T         colour difference that triggers refinement\n"
+		<< "  --termination none|contribution|roulette\n"
+		<< "  --wavefront              use the wavefront engine\n"
+		<< "  --wavefront-size N       paths per wavefront\n"
+		<< "  --morton                 visit tiles, pixels and wavefront paths in Morton order\n"
+		<< "  --sort-rays              sort the wavefront's reflection and shadow rays by direction octant and origin\n"
+		<< "  --stats                  print ray counts (and the stage profile in an RT_PROFILE build)\n"
+		<< "  --heatmap FILE           write the cost of every pixel, .ppm or .pfm (RT_PROFILE builds)\n"
+		<< "  --output FILE            image to write, .ppm or .pfm (float)\n"
+		<< "  --gamma G                gamma curve for 8-bit output\n"
+		<< "  --stream ROWS            render and write bands of ROWS rows\n"
+		<< "  --framebuffer FILE       keep the frame in a tiled file instead of memory, for very large images\n"
+		<< "  --workers N              render in N worker processes (not on Windows)\n"
+		<< "  --worker-timeout S       seconds a worker may spend on a tile before its tiles go to the others\n"
+		<< "  --progressive N          render N passes of one sample per pixel, writing a preview after each\n"
+		<< "  --checkpoint FILE        save progressive state to FILE\n"
+		<< "  --checkpoint-every N     passes between checkpoints\n"
+		<< "  --resume                 continue a progressive render from its checkpoint\n"
+		<< "  --denoise N              filter the frame with N a-trous iterations guided by normals, depth and albedo\n"
+		<< "  --denoise-sigma S        colour tolerance of the denoiser, in local standard deviations\n"
+		<< "  --check-denoise          check that the denoiser brings an undersampled frame closer to the full one\n"
+		<< "  --scene FILE             render a text or binary scene\n"
+		<< "  --random-spheres N       add N small spheres on the ground\n"
+		<< "  --mesh FILE              add an OBJ mesh in place of the red sphere\n"
+		<< "  --instances N            scatter N instances of the last mesh (or of a sphere group) on the ground\n"
+		<< "  --animation FILE         render the frame sequence of an animation file\n"
+		<< "  --frames N               render N frames of bobbing spheres\n"
+		<< "  --refit-threshold T      rebuild a refitted BVH once its SAH cost grows by this factor\n"
+		<< "  --relight                reshade sequence frames that only change the lighting from cached hits\n"
+		<< "  --incremental            retrace only the pixels that objects moved in a sequence frame may change\n"
+		<< "  --serve SOCKET           keep scenes loaded and render them on request, on a Unix socket or - for stdin\n"
+		<< "  --benchmark FILE         render the benchmark scenes and write JSON results (- for stdout)\n"
+		<< "  --benchmark-scenes LIST  comma-separated subset: spheres7,spheres1k,knot6k,knot100k,spheres100k,spheres1M\n"
+		<< "  --save-scene FILE        write the scene as text\n"
+		<< "  --save-binary FILE       write the scene and its BVH as binary" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) options.threads = std::stoi(argv[++i]);
+		else if (arg == "--tile" && i + 1 < argc) options.tileSize = std::stoi(argv[++i]);
+		else if (arg == "--scaling") options.scaling = true;
+		else if (arg == "--no-occluder-cache") options.occluderCache = false;
+		else if (arg == "--light-samples" && i + 1 < argc) options.lightSamples = std::stoi(argv[++i]);
+		else if (arg == "--light-probes" && i + 1 < argc) options.lightProbes = std::stoi(argv[++i]);
+		else if (arg == "--light-tree" && i + 1 < argc) options.lightTreeSamples = std::stoi(argv[++i]);
+		else if (arg == "--light-cull" && i + 1 < argc) options.lightCull = std::stof(argv[++i]);
+		else if (arg == "--random-lights" && i + 1 < argc) options.randomLights = std::stoi(argv[++i]);
+		else if (arg == "--aa-samples" && i + 1 < argc) options.aaMaxSamples = std::stoi(argv[++i]);
+		else if (arg == "--aa-threshold" && i + 1 < argc) options.aaThreshold = std::stof(argv[++i]);
+		else if (arg == "--stats") options.stats = true;
+		else if (arg == "--heatmap" && i + 1 < argc) options.heatmapFile = argv[++i];
+		else if (arg == "--wavefront") options.wavefront = true;
+		else if (arg == "--wavefront-size" && i + 1 < argc) options.wavefrontSize = std::stoi(argv[++i]);
+		else if (arg == "--morton") options.mortonOrder = true;
+		else if (arg == "--sort-rays") options.sortRays = true;
+		else if (arg == "--termination" && i + 1 < argc) {
+			std::string mode = argv[++i];
+			options.termination = mode == "none" ? TERMINATE_NONE : mode == "roulette" ? TERMINATE_ROULETTE : TERMINATE_CONTRIBUTION;
+		}
+		else if (arg == "--random-spheres" && i + 1 < argc) options.randomSpheres = std::stoi(argv[++i]);
+		else if (arg == "--mesh" && i + 1 < argc) options.meshFiles.push_back(argv[++i]);
+		else if (arg == "--instances" && i + 1 < argc) options.instances = std::stoi(argv[++i]);
+		else if (arg == "--animation" && i + 1 < argc) options.animationFile = argv[++i];
+		else if (arg == "--frames" && i + 1 < argc) options.frames = std::stoi(argv[++i]);
+		else if (arg == "--refit-threshold" && i + 1 < argc) options.refitThreshold = std::stof(argv[++i]);
+		else if (arg == "--relight") options.relight = true;
+		else if (arg == "--incremental") options.incremental = true;
+		else if (arg == "--serve" && i + 1 < argc) options.serveSocket = argv[++i];
+		else if (arg == "--benchmark" && i + 1 < argc) options.benchmarkFile = argv[++i];
+		else if (arg == "--benchmark-scenes" && i + 1 < argc) options.benchmarkScenes = argv[++i];
+		else if (arg == "--simd" && i + 1 < argc) {
+			std::string level = argv[++i];
+			options.simd = level == "scalar" ? SIMD_SCALAR : level == "sse" ? SIMD_SSE : level == "avx2" ? SIMD_AVX2 : SIMD_AUTO;
+		}
+		else if (arg == "--output" && i + 1 < argc) options.output = argv[++i];
+		else if (arg == "--gamma" && i + 1 < argc) options.gamma = std::stof(argv[++i]);
+		else if (arg == "--stream" && i + 1 < argc) options.streamRows = std::stoi(argv[++i]);
+		else if (arg == "--framebuffer" && i + 1 < argc) options.framebufferFile = argv[++i];
+		else if (arg == "--workers" && i + 1 < argc) options.workers = std::stoi(argv[++i]);
+		else if (arg == "--worker-timeout" && i + 1 < argc) options.workerTimeout = std::max(1, std::stoi(argv[++i]));
+		else if (arg == "--progressive" && i + 1 < argc) options.passes = std::stoi(argv[++i]);
+		else if (arg == "--checkpoint" && i + 1 < argc) options.checkpointFile = argv[++i];
+		else if (arg == "--checkpoint-every" && i + 1 < argc) options.checkpointEvery = std::stoi(argv[++i]);
+		else if (arg == "--resume") options.resume = true;
+		else if (arg == "--denoise" && i + 1 < argc) options.denoiseIterations = std::stoi(argv[++i]);
+		else if (arg == "--denoise-sigma" && i + 1 < argc) options.denoiseSigma = std::stof(argv[++i]);
+		else if (arg == "--check-denoise") options.checkDenoise = true;
+		else if (arg == "--scene" && i + 1 < argc) options.sceneFile = argv[++i];
+		else if (arg == "--save-scene" && i + 1 < argc) options.saveText = argv[++i];
+		else if (arg == "--save-binary" && i + 1 < argc) options.saveBinary = argv[++i];
+		else {
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.wavefront && (options.lightTreeSamples > 0 || options.lightCull > 0)) {
+		std::cerr << "the wavefront engine evaluates every light; --light-tree and --light-cull use trace() instead" << std::endl;
+		options.wavefront = false;
+	}
+	if (options.sortRays && !options.wavefront) std::cerr << "--sort-rays sorts the rays of the wavefront engine, ignored without --wavefront" << std::endl;
+	if ((options.relight || options.incremental) && options.aaMaxSamples > 1) {
+		std::cerr << "--relight and --incremental keep one camera ray per pixel, --aa-samples ignored" << std::endl;
+		options.aaMaxSamples = 1;
+	}
+	if (!RT_PROFILE && !options.heatmapFile.empty()) std::cerr << "--heatmap needs a build with RT_PROFILE=1, ignored" << std::endl;
+	if (options.denoiseIterations > 0 && (options.workers > 0 || !options.framebufferFile.empty() || options.streamRows > 0 || options.passes > 0)) {
+		std::cerr << "--denoise needs the whole frame in memory, ignored with --workers, --framebuffer, --stream and --progressive" << std::endl;
+	}
+
+	ThreadPool pool(options.threads);
+	if (!options.benchmarkFile.empty()) return runBenchmarks(options.benchmarkFile, pool) ? 0 : 1;
+	if (!options.serveSocket.empty()) return serve(options.serveSocket, pool) ? 0 : 1;
+
+	Scene scene;
+	if (!options.sceneFile.empty()) {
+		if (!loadScene(options.sceneFile, scene)) return 1;
+	}
+	else {
+		// a mesh takes the red sphere's place
+		addDefaultSpheres(scene, options.meshFiles.empty());
+	}
+
+	for (const std::string &file : options.meshFiles) {
+		TriangleMesh mesh;
+		if (!loadObj(file, mesh)) return 1;
+		std::cout << "Loaded " << mesh.triangles.size() << " triangles from " << file << std::endl;
+		addPlacedMesh(scene, std::move(mesh));
+	}
+	addInstances(scene, options.instances);
+	addRandomSpheres(scene, options.randomSpheres);
+	setRandomLights(scene, options.randomLights);
+
+	// binary scenes come with their BVH, unless spheres were added above
+	if (scene.mapping && options.randomSpheres == 0) {
+		scene.buildObjects();
+		scene.prepare(options.simd);
+	}
+	else {
+		scene.build(options.simd);
+	}
+	scene.setOutput(isFloatImage(options.output));
+
+	if (!options.saveText.empty() && !saveSceneText(options.saveText, scene)) std::cerr << "cannot write " << options.saveText << std::endl;
+	if (!options.saveBinary.empty() && !saveSceneBinary(options.saveBinary, scene)) std::cerr << "cannot write " << options.saveBinary << std::endl;
+
+	Animation animation;
+	if (!options.animationFile.empty() && !animation.load(options.animationFile)) return 1;
+	if (options.animationFile.empty() && options.frames > 1) animation.bob(scene, options.frames);
 
-	render(spheres);
+	if (options.checkDenoise) return checkDenoiser(scene, pool) ? 0 : 1;
+	if (options.scaling) measureScaling(scene, pool.size());
+	if (animation.frameCount() > 1) renderSequence(scene, pool, animation);
+	else if (options.passes > 0) renderProgressive(scene, pool);
+	else render(scene, pool);
 
 	return 0;
 }